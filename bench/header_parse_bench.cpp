@@ -0,0 +1,99 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+// Compare the std::regex header parsing (used before) with parseStatusLine/parseHeaderLine.
+// Lines are fed one by one, the same as curl CURLOPT_HEADERFUNCTION.
+
+#include "http_helpers.h"
+#include "ppeureka/http_status.h"
+#include "ppeureka/response.h"
+#include <regex>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+namespace {
+    using namespace ppeureka;
+    using namespace ppeureka::http::impl;
+
+    // a heartbeat response from eureka server
+    const char *const g_lines[] = {
+        "HTTP/1.1 200 OK\r\n",
+        "Content-Type: application/json\r\n",
+        "Content-Length: 0\r\n",
+        "Date: Fri, 16 Oct 2020 08:00:00 GMT\r\n",
+        "Keep-Alive: timeout=60\r\n",
+        "Connection: keep-alive\r\n",
+        "\r\n",
+    };
+    const std::size_t g_lineCount = sizeof(g_lines) / sizeof(g_lines[0]);
+
+    const std::regex g_statusLineRegex(R"***(HTTP\/1\.1 +(\d\d\d) +(.*)\r\n)***");
+    const std::regex g_headerLineRegex(R"***(([^:]+): +(.+)\r\n)***");
+
+    void regexParse(const char *buf, std::size_t size, http::Status &status, ResponseHeaders &headers)
+    {
+        std::cmatch match;
+        if (std::regex_match(buf, buf + size, match, g_statusLineRegex))
+        {
+            status = http::Status(std::atol(match[1].str().c_str()), match[2].str());
+            return;
+        }
+        if (!std::regex_match(buf, buf + size, match, g_headerLineRegex))
+            return;
+        headers[match[1].str()] = match[2].str();
+    }
+
+    void scanParse(const char *buf, std::size_t size, http::Status &status, ResponseHeaders &headers)
+    {
+        int code = 0;
+        const char *reason = nullptr;
+        std::size_t reasonLen = 0;
+        if (parseStatusLine(buf, size, code, reason, reasonLen))
+        {
+            status = http::Status(code, std::string(reason, reasonLen));
+            return;
+        }
+        const char *name = nullptr, *value = nullptr;
+        std::size_t nameLen = 0, valueLen = 0;
+        if (!parseHeaderLine(buf, size, name, nameLen, value, valueLen))
+            return;
+        headers[std::string(name, nameLen)].assign(value, valueLen);
+    }
+
+    template<class F>
+    void run(const char *title, std::size_t responses, F f)
+    {
+        std::size_t sizes[g_lineCount];
+        for (std::size_t i = 0; i < g_lineCount; ++i)
+            sizes[i] = strlen(g_lines[i]);
+
+        std::size_t check = 0;
+        auto tpPrev = std::chrono::steady_clock::now();
+        for (std::size_t n = 0; n < responses; ++n)
+        {
+            http::Status status;
+            ResponseHeaders headers;
+            for (std::size_t i = 0; i < g_lineCount; ++i)
+                f(g_lines[i], sizes[i], status, headers);
+            check += headers.size() + status.code();
+        }
+        auto tpNow = std::chrono::steady_clock::now();
+
+        auto sec = std::chrono::duration_cast<std::chrono::duration<double>>(tpNow - tpPrev).count();
+        std::cout << title << ": " << static_cast<uint64_t>(responses * g_lineCount / sec) << " lines/sec, "
+            << static_cast<uint64_t>(responses / sec) << " responses/sec (check " << check << ")" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t responses = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+
+    run("std::regex", responses, &regexParse);
+    run("scanner   ", responses, &scanParse);
+    return 0;
+}
@@ -36,6 +36,11 @@ namespace ppeureka {
     public:
         using Error::Error;
     };
+
+    class TimeoutError: public NetError{
+    public:
+        using NetError::NetError;
+    };
     
     class FormatError: public Error{
     public:
@@ -14,15 +14,24 @@
 #include "ppeureka/http_client.h"
 #include "ppeureka/helpers.h"
 #include "ppeureka/eureka_connect.h"
+#include "ppeureka/registry_cache.h"
 #include "ppeureka/sync_list.h"
 #include <random>
+#include <condition_variable>
 
 
 namespace ppeureka { namespace agent {
 
     using HttpClientPtr = std::shared_ptr<ppeureka::http::impl::Client>;
     using HttpMethod = ppeureka::http::impl::HttpMethod;
+    using RequestOptions = ppeureka::http::impl::RequestOptions;
+    using PoolStats = ppeureka::http::impl::PoolStats;
+    using CancelToken = ppeureka::http::impl::CancelToken;
+    using CancelTokenPtr = ppeureka::http::impl::CancelTokenPtr;
     using GetResponse = http::impl::Client::GetResponse;
+    using ResponseCallback = http::impl::Client::ResponseCallback;
+    // err is the exception which requestRespData throws, nullptr when suc.
+    using RespDataCallback = std::function<void(std::exception_ptr err, std::string data)>;
 
     // 
     struct AgentSnap;
@@ -93,6 +102,7 @@ namespace ppeureka { namespace agent {
 
         struct CheckInsData
         {
+            std::string             appId;
             bool                    isDeleted{false};  // true if refresh app cannot find this instance
             InstanceInfoPtr         ins;
             HttpClientPtr           cli;
@@ -102,6 +112,19 @@ namespace ppeureka { namespace agent {
         using CheckInsDataPtr = std::shared_ptr<CheckInsData>;
         using CheckInsDataPtrMap = std::map<std::string, CheckInsDataPtr>; // insId->CheckInsData
 
+        // hedged GET of InsHttpClient::requestRespData.
+        //   if no response in delay, the same request is sent to another instance chosen by the app chooser,
+        //   the first answer (not net error or 5xx) is returned and the other request is cancelled.
+        //   delay = average success response time of the instance * latencyFactor, limit in [minDelay, maxDelay].
+        //   if the instance has no statistics, maxDelay is used.
+        struct HedgeConfig
+        {
+            bool                        enable{false};
+            double                      latencyFactor{2.0};
+            std::chrono::milliseconds   minDelay{5};
+            std::chrono::milliseconds   maxDelay{1000};
+        };
+
         struct InsHttpClient;
         using InsHttpClientPtr = std::shared_ptr<InsHttpClient>;
 
@@ -127,13 +150,29 @@ namespace ppeureka { namespace agent {
             virtual ~InsHttpClient();
 
             // throw Error when http client Error exception
-            virtual GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr);
+            //   opts: see http::impl::RequestOptions, e.g. capture no headers, timeouts.
+            //         if null, the agent default (setInsRequestOptions) is used.
+            //         a request aborted by opts->cancelToken is not counted as the instance error.
+            virtual GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr);
             // throw Error when http client exception or HttpCode not 2xx
-            virtual std::string requestRespData(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr);
+            //   response headers are not captured.
+            //   GET is hedged if enabled by setHedgeConfig, except when opts->bodyConsumer is set.
+            //   if opts->bodyConsumer is set, the body is streamed to it and the returned string is empty.
+            virtual std::string requestRespData(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr);
+            // no blocking counterparts of request and requestRespData, run on the shared io engine.
+            //   data must valid until callback called, opts is copied.
+            //   callback is called once in the io thread, or in the caller thread when fail at once, it should not block.
+            //   the client may be released before callback called. requestRespDataAsync is not hedged.
+            virtual void requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback);
+            virtual void requestRespDataAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, RespDataCallback callback);
+            // connection pool statistics of the instance
+            bool getPoolStats(PoolStats &stats) const { return checkIns->cli->getPoolStats(stats); }
 
             InsHttpClient(const InsHttpClient &) = delete;
             InsHttpClient& operator=(const InsHttpClient &) = delete;
         protected:
+            std::string requestHedged(const std::string& path, const std::string& query, const RequestOptions &opts);
+
             friend class EurekaAgent;
             EurekaAgent                  *eAgent{nullptr};
             CheckInsDataPtr              checkIns;
@@ -176,6 +215,19 @@ namespace ppeureka { namespace agent {
         std::string callHttpConfigServer(const std::string &serName, const std::string &tag);
 
 
+        // default options of instance requests, e.g. timeouts. set before start.
+        //   a timeout is counted as an instance error.
+        void setInsRequestOptions(const RequestOptions &opts);
+        // transport of instance clients. set before start.
+        void setInsTransportConfig(const TransportConfig &transport) { m_insTransport = transport; };
+        // pool of instance clients, e.g. warmConnCount to connect a new instance in background. set before start.
+        void setInsPoolConfig(const PoolConfig &pool) { m_insPool = pool; };
+        // default disable. set before start.
+        void setHedgeConfig(const HedgeConfig &cfg) { m_hedge = cfg; };
+        // instances of apps are taken from a local registry cache, which is synced by delta every check period,
+        //   rather than query every app in full. default disable. set before start.
+        void setRegistryCache(bool enable);
+
         void setChooseHttpClient(const std::string &appId, ChooseHttpClientFunction f);
         // get the http client of random instance in app instances.
         //   if none match, throw Error, so return ptr must always valid.
@@ -223,12 +275,30 @@ namespace ppeureka { namespace agent {
         void onInsHttpClientDestroy(const InsHttpClient &httpCli);
         void onInsHttpClientRequestDone(const InsHttpClient &httpCli, bool suc, int64_t respMicroSec);
 
+        struct HedgeState;
+        using HedgeStatePtr = std::shared_ptr<HedgeState>;
+        Duration hedgeDelay(const InsHttpClient &httpCli);
+        // send one request of the hedge, the result is set into state.
+        void startHedgeLeg(const HedgeStatePtr &state, const InsHttpClient &httpCli, const std::string& path, const std::string& query, const RequestOptions &opts);
+        // the InsHttpClient may be released before the async request done, so find the instance by id.
+        void onInsRequestDone(const std::string &appId, const std::string &insId, bool suc, int64_t respMicroSec);
+        // async request of the instance, counted in the instance statistics as InsHttpClient::request.
+        //   if is5xxErr, 5xx httpcode is the instance error and passed to callback as BadStatus.
+        void insRequestAsync(const InsHttpClient &httpCli, HttpMethod method, const std::string& path, const std::string& query, const std::string *data,
+            const std::shared_ptr<RequestOptions> &opts, bool is5xxErr, ResponseCallback callback);
+
         void doTimer();
         void doTimerRegHeart();
         void doTimerCheckApp();
-        void doRegHeart(InnerRegInsData &innerReg);
+        // send heart async, not blocking a do thread each instance.
+        void doRegHeart(const InnerRegInsDataPtr &innerReg);
 
         InsHttpClientPtr chooseHttpClient(CheckAppData &app, lock_type *appLock);
+        // choose one instance of the same app other than httpCli, for the hedge.
+        //   by the chooser of the app if set.
+        // Exception:
+        //    Error if none.
+        InsHttpClientPtr chooseOtherHttpClient(const InsHttpClient &httpCli);
 
         // req apps by conn, add into or refresh m_apps ins, return query app.
         // may be except
@@ -238,13 +308,27 @@ namespace ppeureka { namespace agent {
         EurekaConnect &m_conn;
         std::atomic<bool>   m_stop_flag{false};
         job_thread          m_timer_thread;
-        job_thread          m_do_thread;
 
         lock_type               m_lockReg;
         InnerRegInsDataPtrMap   m_regs;
         
         lock_type               m_lockApp;
         InnerCheckAppDataPtrMap m_apps;
+
+        RequestOptions          m_insReqOpts;
+        RequestOptions          m_insReqOptsNoHeader;   // m_insReqOpts without header capture
+        TransportConfig         m_insTransport;
+        PoolConfig              m_insPool;
+
+        HedgeConfig             m_hedge;
+        std::unique_ptr<RegistryCache>  m_registry;     // null if disabled
+        lock_type               m_lockHedge;
+        std::condition_variable m_hedgeDoneWait;
+        std::size_t             m_hedgeLegCount{0};     // in-flight hedge requests, stop waits them
+
+        lock_type               m_lockAsync;
+        std::condition_variable m_asyncDoneWait;
+        std::size_t             m_asyncCount{0};        // in-flight hearts and async instance requests, stop waits them
     };
 
     struct AgentSnap
@@ -265,10 +349,17 @@ namespace ppeureka { namespace agent {
             std::string                          endpoint;
             EurekaAgent::CheckInsStatistics      statis;
             EurekaAgent::CheckInsErrState        errState;
+            TimingStats                          timing;    // curl phase timings
         };
         // insId -> ReqInsSnapData
         using ReqAppSnapData = std::map<std::string, ReqInsSnapData>;
         // appId -> ReqAppSnapData
         std::map<std::string, ReqAppSnapData>   apps;
+
+        // request timings to eureka servers, endpoint -> stats
+        std::map<std::string, TimingStats>      eurekaEndpoints;
+
+        // the local registry cache if enabled
+        RegistryCache::Stats                    registry;
     };
 }}
\ No newline at end of file
@@ -13,12 +13,26 @@
 #include "ppeureka/response.h"
 #include "ppeureka/http_client.h"
 #include "ppeureka/helpers.h"
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <vector>
+
+
+namespace ppeureka { namespace curl {
+    class HttpEngine;
+}}
 
 
 namespace ppeureka { namespace agent {
 
     using TlsConfig = http::impl::TlsConfig;
+    using TransportConfig = http::impl::TransportConfig;
+    using PoolConfig = http::impl::PoolConfig;
+    using RequestOptions = http::impl::RequestOptions;
     using GetResponse = http::impl::Client::GetResponse;
+    using TimingStats = http::impl::TimingStats;
 
     // RetryFunction
     //   callback function when request has NetError or http code not in (2xx, 4xx).
@@ -31,11 +45,66 @@ namespace ppeureka { namespace agent {
     //   false - end request.
     using RetryFunction = std::function<bool(std::size_t tryCount, const GetResponse *resp)>;
 
+    // callbacks of the async requests, err is the exception which the sync one throws, nullptr when suc.
+    using DoneCallback = std::function<void(std::exception_ptr err)>;
+    using QueryCallback = std::function<void(std::exception_ptr err, InstanceInfoPtrDeque inses)>;
+
+    // token bucket limit the retries, so the retries are a ratio of requests when the servers fail,
+    //   rather than every caller retry at once. thread safe.
+    //   each success request deposits ratio token, each retry withdraws 1 token, tokens at most maxTokens.
+    class RetryBudget
+    {
+    public:
+        struct Stats
+        {
+            uint64_t    retried{0};     // retries withdrawn
+            uint64_t    denied{0};      // retries refused as no token
+            double      tokens{0};
+        };
+
+        explicit RetryBudget(double ratio = 0.1, double maxTokens = 100)
+            : m_ratio(ratio), m_maxTokens(maxTokens), m_tokens(maxTokens) {
+        }
+
+        // shared by all connects in process by default.
+        static RetryBudget &shared();
+
+        void configure(double ratio, double maxTokens);
+        void deposit();
+        // false if no token.
+        bool withdraw();
+        Stats stats() const;
+
+        RetryBudget(const RetryBudget&) = delete;
+        RetryBudget& operator= (const RetryBudget&) = delete;
+
+    private:
+        mutable std::mutex  m_lock;
+        double              m_ratio;
+        double              m_maxTokens;
+        double              m_tokens;
+        uint64_t            m_retried{0};
+        uint64_t            m_denied{0};
+    };
+
+    // policy of EurekaConnect::defaultRetry.
+    struct RetryPolicy
+    {
+        // sleep before retry random(0, min(maxDelay, baseDelay * 2^n)), n = retries done.
+        //   for net error and every 5xx, including the first switch to another endpoint.
+        std::chrono::milliseconds   baseDelay{100};
+        std::chrono::milliseconds   maxDelay{3000};
+        // nullptr for no budget.
+        RetryBudget                 *budget{&RetryBudget::shared()};
+    };
+
     class EurekaConnect
     {
         using HttpMethod = ppeureka::http::impl::HttpMethod;
+        using lock_type = std::mutex;
+        using auto_lock_type = std::unique_lock<lock_type>;
     public:
-        EurekaConnect() = default;
+        EurekaConnect();
 
         // connection count set
         void setDefaultConnCount(std::size_t defaultConnCount=3) { m_defaultConnCount = defaultConnCount; };
@@ -43,37 +112,61 @@ namespace ppeureka { namespace agent {
 
         // if tls.keyPass valid, it must valid until stop
         void setTls(const TlsConfig &tls) { m_tls = tls; };
+        // default share dns cache and tls sessions in process, and accept gzip registry.
+        //   an empty transport.acceptEncoding keeps gzip, set "identity" to not compress.
+        //   gzip only saves the transfer, the registry is still buffered whole for the json parser.
+        // if transport.httpVersion is http/2, all requests are multiplexed on the shared async engine,
+        //   rather than one connection per concurrent request.
+        void setTransport(const TransportConfig &transport);
+        // pool of every endpoint, e.g. maxConnWaitTimeout. not used by http/2.
+        void setPoolConfig(const PoolConfig &pool) { m_pool = pool; };
+        // timeouts of every request to eureka server, default connect 5s and abort when stalled 30s.
+        //   a timeout is a NetError, so the next endpoint will be tried.
+        //   the header capture, body consumer and body buffers of opts are ignored.
+        void setRequestOptions(const RequestOptions &opts);
         void setEndpoints(const StringList &endpoints) { m_endpoints = endpoints; };
+        // the async requests call f in the io thread, it should not block.
         void setRetryFunction(RetryFunction f) { m_retryFunc = std::move(f); };
+        // the policy of default retry. budget must valid until stop.
+        void setRetryPolicy(const RetryPolicy &policy) { m_retryPolicy = policy; };
 
         // Exception:
         //    ppeureka::ParamError when parameter error.
         //    ppeureka::Error when others.
         void start();
-        // set stop flag, and wait all request end.
+        // set stop flag, and wait all request end, include the async ones.
+        //   do not call it in the callback of async request.
         void stop();
 
-        // switch current endpoint
+        // switch current endpoint, every endpoint has its own connections, so they are kept warm.
+        //   a redirect to a peer not in endpoints ends.
         // Params:
         //   endpointIndex - will % size()
         void switchEndpoint(std::size_t endpointIndex);
         std::string currentEndPoint() const;
+        // request timings of every endpoint and redirected peer from start, endpoint -> stats
+        void getEndpointTimingStats(std::map<std::string, TimingStats> &stats) const;
 
         // concurrent request parallel.
         // All net request may be Exception.
         // Exception:
         //    ppeureka::OperationAborted when request cancelled.
         //    ppeureka::ParamError when parameter error.
-        //    ppeureka::NetError when net error.
+        //    ppeureka::NetError when net error, ppeureka::TimeoutError when timeout.
         //    ppeureka::BadStatus when http code not match.
         //    ppeureka::FormatError when json parse fail.
         //    ppeureka::Error when others.
+        // concurrent same queries share one in-flight request, every caller gets its own copy of the instances.
 
         InstanceInfoPtrDeque queryInsAll();
         InstanceInfoPtrDeque queryInsByAppId(const std::string &appId);
         InstanceInfoPtrDeque queryInsByAppIdInsId(const std::string &appId, const std::string &insId);
         InstanceInfoPtrDeque queryInsByVip(const std::string &vip);
         InstanceInfoPtrDeque queryInsBySVip(const std::string &svip);
+        // the full registry, and the changes of recent minutes, with versionsDelta and appsHashCode set.
+        //   not single flight, see RegistryCache for the delta sync.
+        ApplicationsPtr queryApps();
+        ApplicationsPtr queryAppsDelta();
 
         InstanceInfoPtr getEmptyIns(const std::string &appId, const std::string &insId, int port, const std::string &ipAddr=""); 
 
@@ -84,8 +177,76 @@ namespace ppeureka { namespace agent {
         void statusUp(const std::string &appId, const std::string &insId);
         void updateMetadata(const std::string &appId, const std::string &insId, const std::string &key, const std::string &value);
 
+        // no blocking counterparts, the requests and the retry backoff run on the shared io engine,
+        //   so many requests are in flight without a thread each.
+        // callback is called once when request done, in the io thread, or in the caller thread when fail at once.
+        //   it should not block, and the parse of queries runs in the io thread too.
+        // concurrent same queries share one in-flight request with the sync ones.
+
+        void queryInsAllAsync(QueryCallback callback);
+        void queryInsByAppIdAsync(const std::string &appId, QueryCallback callback);
+        void queryInsByAppIdInsIdAsync(const std::string &appId, const std::string &insId, QueryCallback callback);
+        void queryInsByVipAsync(const std::string &vip, QueryCallback callback);
+        void queryInsBySVipAsync(const std::string &svip, QueryCallback callback);
+
+        void registerInsAsync(const InstanceInfoPtr &ins, DoneCallback callback);
+        void unregisterInsAsync(const std::string &appId, const std::string &insId, DoneCallback callback);
+        void sendHeartAsync(const std::string &appId, const std::string &insId, DoneCallback callback);
+        void statusOutOfServiceAsync(const std::string &appId, const std::string &insId, DoneCallback callback);
+        void statusUpAsync(const std::string &appId, const std::string &insId, DoneCallback callback);
+        void updateMetadataAsync(const std::string &appId, const std::string &insId, const std::string &key, const std::string &value, DoneCallback callback);
+
+        // same as the async ones, the future get() throw the request exception.
+
+        std::future<InstanceInfoPtrDeque> queryInsAllFuture()
+        {
+            return toQueryFuture([this](QueryCallback cb){ queryInsAllAsync(std::move(cb)); });
+        }
+        std::future<InstanceInfoPtrDeque> queryInsByAppIdFuture(const std::string &appId)
+        {
+            return toQueryFuture([&](QueryCallback cb){ queryInsByAppIdAsync(appId, std::move(cb)); });
+        }
+        std::future<InstanceInfoPtrDeque> queryInsByAppIdInsIdFuture(const std::string &appId, const std::string &insId)
+        {
+            return toQueryFuture([&](QueryCallback cb){ queryInsByAppIdInsIdAsync(appId, insId, std::move(cb)); });
+        }
+        std::future<InstanceInfoPtrDeque> queryInsByVipFuture(const std::string &vip)
+        {
+            return toQueryFuture([&](QueryCallback cb){ queryInsByVipAsync(vip, std::move(cb)); });
+        }
+        std::future<InstanceInfoPtrDeque> queryInsBySVipFuture(const std::string &svip)
+        {
+            return toQueryFuture([&](QueryCallback cb){ queryInsBySVipAsync(svip, std::move(cb)); });
+        }
+
+        std::future<void> registerInsFuture(const InstanceInfoPtr &ins)
+        {
+            return toDoneFuture([&](DoneCallback cb){ registerInsAsync(ins, std::move(cb)); });
+        }
+        std::future<void> unregisterInsFuture(const std::string &appId, const std::string &insId)
+        {
+            return toDoneFuture([&](DoneCallback cb){ unregisterInsAsync(appId, insId, std::move(cb)); });
+        }
+        std::future<void> sendHeartFuture(const std::string &appId, const std::string &insId)
+        {
+            return toDoneFuture([&](DoneCallback cb){ sendHeartAsync(appId, insId, std::move(cb)); });
+        }
+        std::future<void> statusOutOfServiceFuture(const std::string &appId, const std::string &insId)
+        {
+            return toDoneFuture([&](DoneCallback cb){ statusOutOfServiceAsync(appId, insId, std::move(cb)); });
+        }
+        std::future<void> statusUpFuture(const std::string &appId, const std::string &insId)
+        {
+            return toDoneFuture([&](DoneCallback cb){ statusUpAsync(appId, insId, std::move(cb)); });
+        }
+        std::future<void> updateMetadataFuture(const std::string &appId, const std::string &insId, const std::string &key, const std::string &value)
+        {
+            return toDoneFuture([&](DoneCallback cb){ updateMetadataAsync(appId, insId, key, value, std::move(cb)); });
+        }
+
         // the default retry implement:
         //   when NetError or http code not in (2xx, 4xx), do retry, and when NetError, Connect will choose next endpoint to request.
+        //   sleep with backoff and the budget limit the retries, see RetryPolicy.
         // when tryCount great than 2 * endpoints.size(), retry end.
         bool defaultRetry(std::size_t tryCount, const GetResponse *resp);
 
@@ -97,23 +258,122 @@ namespace ppeureka { namespace agent {
         //   true - if http code in (2xx)
         //   false - if not in (2xx)
         bool checkHttpCodeSuc(const GetResponse &resp, bool &needRetry);
-        bool doRetry(std::size_t tryCount, const GetResponse *resp);
+        // Params:
+        //   delay - out, the time to wait before retry.
+        bool doRetry(std::size_t tryCount, const GetResponse *resp, std::chrono::milliseconds &delay);
+        // defaultRetry without sleep, the sleep time is set to delay.
+        bool checkRetry(std::size_t tryCount, const GetResponse *resp, std::chrono::milliseconds &delay);
+        // switch to the peer of the 307 Location.
+        // Returns:
+        //   false if no Location.
+        bool followRedirect(const GetResponse &resp);
+        // random time to wait before retry
+        std::chrono::milliseconds retryBackoff(std::size_t tryCount);
+        http::impl::Client &currentClient();
+        std::unique_ptr<http::impl::Client> createClient(const std::string &endpoint);
+        // the requests go to the peer of a 307 which is not in endpoints, until the next switch.
+        // Returns:
+        //   false if too many peers redirected to, not followed.
+        // Exception:
+        //    see Client::start.
+        bool redirectTo(const std::string &origin);
 
         
 
         GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr);
 
+        using ResponseCallback = http::impl::Client::ResponseCallback;
+        struct AsyncRequest
+        {
+            HttpMethod          method;
+            std::string         path;
+            std::string         query;
+            std::string         data;
+            bool                hasData{false};
+            std::size_t         tryCount{0};
+            ResponseCallback    callback;
+        };
+        using AsyncRequestPtr = std::shared_ptr<AsyncRequest>;
+        // same retry as request, the backoff is a timer of the io engine.
+        void requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, ResponseCallback callback);
+        void sendAsync(const AsyncRequestPtr &req);
+        void onAsyncResponse(const AsyncRequestPtr &req, std::exception_ptr err, GetResponse resp);
+        void endAsync(const AsyncRequestPtr &req, std::exception_ptr err, GetResponse resp);
+
+        using ParseFunction = InstanceInfoPtrDeque (*)(const GetResponse &resp);
+        using QueryFuture = std::shared_future<InstanceInfoPtrDeque>;
+        using QueryPromisePtr = std::shared_ptr<std::promise<InstanceInfoPtrDeque>>;
+        struct Flight
+        {
+            QueryFuture                 fut;
+            std::vector<QueryCallback>  callbacks;  // async callers
+            std::size_t                 waitCount{0};   // sync callers wait fut, except the leader
+        };
+        // single flight: the first caller of path requests, the concurrent callers wait its result.
+        InstanceInfoPtrDeque querySingleFlight(const std::string &path, ParseFunction parse);
+        void querySingleFlightAsync(const std::string &path, ParseFunction parse, QueryCallback callback);
+        // Returns:
+        //   the promise if the caller starts the flight, else nullptr and fut is set to the in-flight one.
+        QueryPromisePtr joinFlight(const std::string &path, QueryFuture &fut, QueryCallback callback);
+        // Params:
+        //   ret: the result of the sync leader, null if async.
+        void endFlight(const std::string &path, const QueryPromisePtr &prom, std::exception_ptr err, InstanceInfoPtrDeque inses, InstanceInfoPtrDeque *ret);
+        // deep copy, the shared result is not modified by the callers.
+        static InstanceInfoPtrDeque copyInstances(const InstanceInfoPtrDeque &inses);
+
+        template<class AsyncFunction>
+        static std::future<InstanceInfoPtrDeque> toQueryFuture(AsyncFunction func)
+        {
+            auto prom = std::make_shared<std::promise<InstanceInfoPtrDeque>>();
+            auto fut = prom->get_future();
+            func([prom](std::exception_ptr err, InstanceInfoPtrDeque inses){
+                if (err)
+                    prom->set_exception(err);
+                else
+                    prom->set_value(std::move(inses));
+            });
+            return fut;
+        }
+        template<class AsyncFunction>
+        static std::future<void> toDoneFuture(AsyncFunction func)
+        {
+            auto prom = std::make_shared<std::promise<void>>();
+            auto fut = prom->get_future();
+            func([prom](std::exception_ptr err){
+                if (err)
+                    prom->set_exception(err);
+                else
+                    prom->set_value();
+            });
+            return fut;
+        }
+
     private:
         
 
         std::size_t      m_defaultConnCount{3};
         std::size_t      m_maxConnCount{1000};
 
-        std::unique_ptr<http::impl::Client> m_client;
+        std::vector<std::unique_ptr<http::impl::Client>> m_clients;    // one per endpoint, same index
         std::atomic<std::size_t>            m_endpointsIndex{0};
+        mutable lock_type                   m_lockRedirect;
+        std::map<std::string, std::unique_ptr<http::impl::Client>> m_redirectClients;  // origin -> client, kept until start, limited and never evicted
+        std::atomic<http::impl::Client *>   m_redirectClient{nullptr};  // current one of m_redirectClients, null if not redirected
         StringList                          m_endpoints;
         http::impl::TlsConfig               m_tls;
+        http::impl::TransportConfig         m_transport;
+        http::impl::PoolConfig              m_pool;
+        http::impl::RequestOptions          m_reqOpts;
         RetryFunction                       m_retryFunc{nullptr};
+        RetryPolicy                         m_retryPolicy;
+
+        lock_type                           m_lockFlight;
+        std::map<std::string, Flight>       m_flights;  // path -> in-flight query
+
+        lock_type                           m_lockAsync;
+        std::condition_variable             m_asyncDoneWait;
+        std::size_t                         m_asyncCount{0};
+        std::shared_ptr<curl::HttpEngine>   m_engine;   // backoff timers of the async requests
     };
 
 
@@ -0,0 +1,225 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+// optional, co_await-able queries of EurekaConnect and requests of InsHttpClient, need C++20 coroutines.
+//   the library itself is built as C++11, only the users include this.
+
+#include "ppeureka/eureka_connect.h"
+#include "ppeureka/eureka_agent.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "ppeureka/eureka_coro.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <atomic>
+
+
+namespace ppeureka { namespace agent { namespace coro {
+
+    // run the resume of a coroutine, e.g. post it to a thread pool.
+    using Executor = std::function<void(std::function<void()> resume)>;
+
+    // awaitable of an async operation, start(callback) is called when co_await.
+    //   by default the coroutine is resumed in the io thread of the shared HttpEngine which completes the operation.
+    //   all the async requests of the process are done by that thread, so the code after co_await must not block,
+    //   e.g. no sync request or wait, until switched to another thread. set an executor by via() to resume there:
+    //       auto inses = co_await coro::queryInsAll(conn).via([&pool](std::function<void()> f){ pool.post(std::move(f)); });
+    //   if the operation fails at once, e.g. stopped, it is not suspended and continues in the awaiting thread.
+    // co_await returns the result, or throws the exception which the sync one throws.
+    template<class T>
+    class Awaitable
+    {
+    public:
+        using Callback = std::function<void(std::exception_ptr err, T result)>;
+        using StartFunction = std::function<void(Callback callback)>;
+
+        explicit Awaitable(StartFunction start) : m_start(std::move(start)) {}
+        // only before co_await
+        Awaitable(Awaitable &&other) : m_start(std::move(other.m_start)), m_executor(std::move(other.m_executor)) {}
+
+        // resume by executor rather than in the io thread.
+        Awaitable via(Executor executor) &&
+        {
+            m_executor = std::move(executor);
+            return std::move(*this);
+        }
+
+        bool await_ready() const PPEUREKA_NOEXCEPT { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_handle = handle;
+            m_start([this](std::exception_ptr err, T result){
+                m_err = err;
+                m_result = std::move(result);
+                // the later one of callback and await_suspend resumes
+                if (m_done.exchange(true))
+                    resume();
+            });
+            return !m_done.exchange(true);
+        }
+
+        T await_resume()
+        {
+            if (m_err)
+                std::rethrow_exception(m_err);
+            return std::move(m_result);
+        }
+
+    private:
+        void resume()
+        {
+            if (!m_executor)
+            {
+                m_handle.resume();
+                return;
+            }
+            // the awaitable is in the coroutine frame, which may be destroyed by the resumed one
+            //   before the executor returns, so not touch this after handoff.
+            auto exec = m_executor;
+            auto handle = m_handle;
+            exec([handle](){
+                handle.resume();
+            });
+        }
+
+        StartFunction           m_start;
+        Executor                m_executor;
+        std::coroutine_handle<> m_handle;
+        std::atomic<bool>       m_done{false};
+        std::exception_ptr      m_err;
+        T                       m_result{};
+    };
+
+    template<>
+    class Awaitable<void>
+    {
+    public:
+        using Callback = std::function<void(std::exception_ptr err)>;
+        using StartFunction = std::function<void(Callback callback)>;
+
+        explicit Awaitable(StartFunction start) : m_start(std::move(start)) {}
+        Awaitable(Awaitable &&other) : m_start(std::move(other.m_start)), m_executor(std::move(other.m_executor)) {}
+
+        Awaitable via(Executor executor) &&
+        {
+            m_executor = std::move(executor);
+            return std::move(*this);
+        }
+
+        bool await_ready() const PPEUREKA_NOEXCEPT { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_handle = handle;
+            m_start([this](std::exception_ptr err){
+                m_err = err;
+                if (m_done.exchange(true))
+                    resume();
+            });
+            return !m_done.exchange(true);
+        }
+
+        void await_resume()
+        {
+            if (m_err)
+                std::rethrow_exception(m_err);
+        }
+
+    private:
+        void resume()
+        {
+            if (!m_executor)
+            {
+                m_handle.resume();
+                return;
+            }
+            // the awaitable is in the coroutine frame, which may be destroyed by the resumed one
+            //   before the executor returns, so not touch this after handoff.
+            auto exec = m_executor;
+            auto handle = m_handle;
+            exec([handle](){
+                handle.resume();
+            });
+        }
+
+        StartFunction           m_start;
+        Executor                m_executor;
+        std::coroutine_handle<> m_handle;
+        std::atomic<bool>       m_done{false};
+        std::exception_ptr      m_err;
+    };
+
+    // EurekaConnect queries, see EurekaConnect::queryInsAllAsync.
+    //   conn must valid until resumed.
+
+    inline Awaitable<InstanceInfoPtrDeque> queryInsAll(EurekaConnect &conn)
+    {
+        return Awaitable<InstanceInfoPtrDeque>([&conn](QueryCallback cb){
+            conn.queryInsAllAsync(std::move(cb));
+        });
+    }
+
+    inline Awaitable<InstanceInfoPtrDeque> queryInsByAppId(EurekaConnect &conn, std::string appId)
+    {
+        return Awaitable<InstanceInfoPtrDeque>([&conn, appId = std::move(appId)](QueryCallback cb){
+            conn.queryInsByAppIdAsync(appId, std::move(cb));
+        });
+    }
+
+    inline Awaitable<InstanceInfoPtrDeque> queryInsByAppIdInsId(EurekaConnect &conn, std::string appId, std::string insId)
+    {
+        return Awaitable<InstanceInfoPtrDeque>([&conn, appId = std::move(appId), insId = std::move(insId)](QueryCallback cb){
+            conn.queryInsByAppIdInsIdAsync(appId, insId, std::move(cb));
+        });
+    }
+
+    inline Awaitable<InstanceInfoPtrDeque> queryInsByVip(EurekaConnect &conn, std::string vip)
+    {
+        return Awaitable<InstanceInfoPtrDeque>([&conn, vip = std::move(vip)](QueryCallback cb){
+            conn.queryInsByVipAsync(vip, std::move(cb));
+        });
+    }
+
+    inline Awaitable<InstanceInfoPtrDeque> queryInsBySVip(EurekaConnect &conn, std::string svip)
+    {
+        return Awaitable<InstanceInfoPtrDeque>([&conn, svip = std::move(svip)](QueryCallback cb){
+            conn.queryInsBySVipAsync(svip, std::move(cb));
+        });
+    }
+
+    inline Awaitable<void> sendHeart(EurekaConnect &conn, std::string appId, std::string insId)
+    {
+        return Awaitable<void>([&conn, appId = std::move(appId), insId = std::move(insId)](DoneCallback cb){
+            conn.sendHeartAsync(appId, insId, std::move(cb));
+        });
+    }
+
+    // InsHttpClient requests, see InsHttpClient::requestAsync.
+    //   the arguments are kept by the awaitable until resumed. opts null for the agent default.
+
+    inline Awaitable<GetResponse> request(EurekaAgent::InsHttpClientPtr cli, HttpMethod method, std::string path, std::string query,
+        std::string data = std::string(), const RequestOptions *opts = nullptr)
+    {
+        auto optsCopy = opts ? std::make_shared<RequestOptions>(*opts) : nullptr;
+        return Awaitable<GetResponse>([cli = std::move(cli), method, path = std::move(path), query = std::move(query), data = std::move(data), optsCopy](ResponseCallback cb){
+            cli->requestAsync(method, path, query, data.empty() ? nullptr : &data, optsCopy.get(), std::move(cb));
+        });
+    }
+
+    inline Awaitable<std::string> requestRespData(EurekaAgent::InsHttpClientPtr cli, HttpMethod method, std::string path, std::string query,
+        std::string data = std::string(), const RequestOptions *opts = nullptr)
+    {
+        auto optsCopy = opts ? std::make_shared<RequestOptions>(*opts) : nullptr;
+        return Awaitable<std::string>([cli = std::move(cli), method, path = std::move(path), query = std::move(query), data = std::move(data), optsCopy](RespDataCallback cb){
+            cli->requestRespDataAsync(method, path, query, data.empty() ? nullptr : &data, optsCopy.get(), std::move(cb));
+        });
+    }
+
+}}}
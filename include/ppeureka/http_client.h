@@ -8,8 +8,19 @@
 
 #include "ppeureka/http_status.h"
 #include "ppeureka/response.h"
+#include "ppeureka/error.h"
 #include <tuple>
 #include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <cstdint>
 
 
 namespace ppeureka { namespace http { namespace impl {
@@ -20,6 +31,7 @@ namespace ppeureka { namespace http { namespace impl {
         METHOD_POST,
         METHOD_PUT,
         METHOD_DELETE,
+        METHOD_HEAD,
     };
 
     struct TlsConfig
@@ -43,27 +55,317 @@ namespace ppeureka { namespace http { namespace impl {
         const char *keyPass = nullptr;
     };
 
+    enum HttpVersion
+    {
+        HTTP_VERSION_DEFAULT = 0,       // curl default
+        HTTP_VERSION_1_1,
+        HTTP_VERSION_2,                 // http/2 negotiated by tls alpn, http/1.1 for plain http
+        HTTP_VERSION_2_PRIOR_KNOWLEDGE, // also http/2 for plain http(h2c) without upgrade
+    };
+
+    struct TransportConfig
+    {
+        TransportConfig() = default;
+
+        // when http/2, requests of async client are multiplexed on few connections.
+        HttpVersion httpVersion = HTTP_VERSION_DEFAULT;
+
+        // share dns cache and tls sessions with all clients in process,
+        // so a new connection need not resolve again and the tls session is resumed.
+        bool shareDns = true;
+        bool shareTlsSession = true;
+        // share idle connections with all clients in process.
+        //   the idle connections are limited by maxConnects, 0 for curl default(5).
+        bool shareConnections = false;
+        long maxConnects = 0;
+
+        // socket options.
+        //   tcpKeepAlive probes idle connections, so they survive the nat and dead ones are found.
+        bool tcpNoDelay = true;
+        bool tcpKeepAlive = false;
+        std::chrono::seconds tcpKeepIdle{60};       // idle time before the first probe
+        std::chrono::seconds tcpKeepInterval{60};   // between probes
+        // local interface name, ip or host name to bind, e.g. "eth0". empty for any.
+        std::string localInterface;
+        // connect to the unix domain socket rather than the endpoint host, e.g. a local proxy.
+        //   the endpoint is still used for url and Host header.
+        std::string unixSocketPath;
+
+        // Accept-Encoding sent, e.g. "gzip". empty for no compression.
+        //   the response is decompressed while received, compressed data is never buffered.
+        //   ignored if curl is built without zlib.
+        std::string acceptEncoding;
+    };
+
+    // options of the client pool, see create_client_pool.
+    struct PoolConfig
+    {
+        PoolConfig() = default;
+
+        // open warmConnCount keep-alive connections in background when the pool starts,
+        //   by HEAD warmPath on each new client, so the first requests skip tcp and tls setup.
+        //   the pool keeps at least warmConnCount connections, so they are not closed as idle later.
+        std::size_t warmConnCount = 0;
+        std::string warmPath = "/";
+
+        // when all max count connections are in use, a blocking request waits in fifo order
+        //   for a free one up to maxConnWaitTimeout, rather than fail. 0 for fail at once.
+        //   an async request never waits.
+        std::chrono::milliseconds maxConnWaitTimeout{0};
+
+        // idle connections kept more than the smoothed concurrent usage, see PoolStats.
+        std::size_t minIdleConnCount = 1;
+    };
+
+    // phase times of a request in microseconds, each is from the request start to the phase done.
+    //   see CURLINFO_*_TIME of curl_easy_getinfo.
+    struct RequestTiming
+    {
+        int64_t nameLookup = 0;     // dns resolved
+        int64_t connect = 0;        // tcp connected
+        int64_t appConnect = 0;     // tls handshake done, 0 for plain http
+        int64_t preTransfer = 0;    // about to send
+        int64_t startTransfer = 0;  // first response byte, the server time is startTransfer - preTransfer
+        int64_t total = 0;
+        int64_t uploadBytes = 0;
+        int64_t downloadBytes = 0;
+    };
+
+    // sum of the request timings of a client from start, include failed requests.
+    struct TimingStats
+    {
+        uint64_t count = 0;
+        RequestTiming sum;
+
+        RequestTiming avg() const
+        {
+            RequestTiming a;
+            if (!count)
+                return a;
+            const auto n = static_cast<int64_t>(count);
+            a.nameLookup = sum.nameLookup / n;
+            a.connect = sum.connect / n;
+            a.appConnect = sum.appConnect / n;
+            a.preTransfer = sum.preTransfer / n;
+            a.startTransfer = sum.startTransfer / n;
+            a.total = sum.total / n;
+            a.uploadBytes = sum.uploadBytes / n;
+            a.downloadBytes = sum.downloadBytes / n;
+            return a;
+        }
+    };
+
+    // statistics of a pool client, counts are from start.
+    struct PoolStats
+    {
+        std::size_t clientCount = 0;    // clients created and not closed
+        std::size_t usingCount = 0;
+        double usageAverage = 0;        // moving average of the peak concurrent usage every 30 seconds
+        uint64_t checkoutCount = 0;     // requests took a client
+        uint64_t hitCount = 0;          // requests took an idle client, no waiting and no new connection
+        uint64_t createCount = 0;
+        uint64_t closeCount = 0;
+
+        double hitRate() const { return checkoutCount ? static_cast<double>(hitCount) / checkoutCount : 0; }
+    };
+
+    // abort requests when the caller gives up. thread safe.
+    //   one token may be shared by several requests, cancel() aborts all of them.
+    class CancelToken
+    {
+    public:
+        CancelToken() = default;
+        // also cancelled when parent cancelled, e.g. the sub requests of one call.
+        explicit CancelToken(std::shared_ptr<const CancelToken> parent)
+            : m_parent(std::move(parent)) {
+        }
+
+        // the hooks added are called once by the thread cancels, e.g. to wake the transfers waiting in io thread.
+        void cancel()
+        {
+            std::map<uint64_t, std::function<void()>> hooks;
+            {
+                std::lock_guard<std::mutex> al{m_lockHooks};
+                if (m_cancelled.exchange(true))
+                    return;
+                hooks.swap(m_hooks);
+            }
+            for (auto &&st : hooks)
+            {
+                st.second();
+            }
+        }
+        bool isCancelled() const {
+            return m_cancelled.load(std::memory_order_relaxed) || (m_parent && m_parent->isCancelled());
+        }
+
+        // the hook is called when this one cancelled, at once if cancelled already. the parent is not watched.
+        // Returns:
+        //   id to remove the hook, 0 if called at once.
+        uint64_t addCancelHook(std::function<void()> hook) const
+        {
+            {
+                std::lock_guard<std::mutex> al{m_lockHooks};
+                if (!m_cancelled.load())
+                {
+                    auto id = ++m_lastHookId;
+                    m_hooks.emplace(id, std::move(hook));
+                    return id;
+                }
+            }
+            hook();
+            return 0;
+        }
+        void removeCancelHook(uint64_t id) const
+        {
+            std::lock_guard<std::mutex> al{m_lockHooks};
+            m_hooks.erase(id);
+        }
+        const std::shared_ptr<const CancelToken>& parent() const { return m_parent; }
+
+    private:
+        std::atomic<bool> m_cancelled{false};
+        std::shared_ptr<const CancelToken> m_parent;
+        mutable std::mutex m_lockHooks;
+        mutable uint64_t m_lastHookId{0};
+        mutable std::map<uint64_t, std::function<void()>> m_hooks;
+    };
+    using CancelTokenPtr = std::shared_ptr<CancelToken>;
+
+    // non-owning view of a part of the request body.
+    struct BodyBuffer
+    {
+        const char *data;
+        size_t size;
+    };
+    using BodyBuffers = std::vector<BodyBuffer>;
+
+    // data is valid only in the call.
+    using BodyConsumer = std::function<bool(const char *data, size_t size)>;
+
+    struct RequestOptions
+    {
+        RequestOptions() = default;
+
+        enum HeaderCapture
+        {
+            HEADERS_ALL = 0,    // capture all response headers
+            HEADERS_NONE,       // capture no header, status is still parsed
+            HEADERS_NAMED,      // capture only headers in headerNames
+        };
+
+        HeaderCapture headerCapture = HEADERS_ALL;
+        // used when HEADERS_NAMED, case insensitive. e.g. {"Location"}
+        std::vector<std::string> headerNames;
+
+        // 0 for no limit. ppeureka::TimeoutError is thrown when exceed.
+        std::chrono::milliseconds connectTimeout{0};    // connect, include tls handshake
+        std::chrono::milliseconds timeout{0};           // the whole request
+        // abort when transfer speed below lowSpeedLimit bytes/second for lowSpeedTime.
+        long lowSpeedLimit = 0;
+        std::chrono::seconds lowSpeedTime{0};
+
+        // when cancelled, the request is aborted soon and ppeureka::OperationAborted is thrown,
+        //   the connection is closed rather than finishing the transfer.
+        CancelTokenPtr cancelToken;
+
+        // when set, the body is passed to it chunk by chunk while received rather than buffered,
+        //   so the body of the response is empty. the chunks of a non 2xx response are passed too.
+        //   return false to abort the request, then ppeureka::OperationAborted is thrown.
+        //   an exception thrown by it aborts the request and is rethrown by request().
+        //   called in the thread performing the request (io thread for async client), it should not block.
+        BodyConsumer bodyConsumer;
+
+        // used when the data of request is null, the body is gathered from them while sent,
+        //   so parts need not be joined into one string. the memory must valid until request done.
+        BodyBuffers bodyBuffers;
+    };
+
     class Client
     {
     public:
         using GetResponse = std::tuple<http::Status, ResponseHeaders, std::string>;
+        // err is null when request done, then resp is {status, headers, body}.
+        // err holds the same exception that request() would throw.
+        using ResponseCallback = std::function<void(std::exception_ptr err, GetResponse resp)>;
 
-        virtual void start(const std::string& endpoint, const TlsConfig& tlsConfig) = 0;
+        virtual void start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig = TransportConfig{}) = 0;
 
         // update endpoint
         // if a pool, all request later will use the newer endpoint
         virtual void setEndpoint(const std::string &endpoint) = 0;
 
-        // when method in (POST,PUT), data should be set.
+        // when method in (POST,PUT), data or opts->bodyBuffers should be set, it is not copied.
+        // opts nullptr same as default RequestOptions, it must valid until request done.
         //   if a pool, concurrent requests will use different client and reqeusts parallel.
         //   if not pool, concurrent requests will sequential.
         // Returns {status, headers, body}
         // Exception:
-        //    ppeureka::OperationAborted when request cancelled.
+        //    ppeureka::OperationAborted when client stopped or opts->cancelToken cancelled.
         //    ppeureka::ParamError when parameter error.
-        //    ppeureka::NetError when net error.
+        //    ppeureka::NetError when net error, ppeureka::TimeoutError when timeout.
         //    ppeureka::Error when others.
-        virtual GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr) = 0;
+        virtual GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr) = 0;
+
+        // same as request, but the body is passed to consumer while received, see RequestOptions::bodyConsumer.
+        // Returns {status, headers, empty body}
+        GetResponse requestStream(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, BodyConsumer consumer, const RequestOptions *opts = nullptr)
+        {
+            RequestOptions streamOpts;
+            if (opts)
+                streamOpts = *opts;
+            streamOpts.bodyConsumer = std::move(consumer);
+            return request(method, path, query, data, &streamOpts);
+        }
+
+        // same as request, but the body is gathered from buffers, see RequestOptions::bodyBuffers.
+        GetResponse requestBuffers(HttpMethod method, const std::string& path, const std::string& query, BodyBuffers buffers, const RequestOptions *opts = nullptr)
+        {
+            RequestOptions gatherOpts;
+            if (opts)
+                gatherOpts = *opts;
+            gatherOpts.bodyBuffers = std::move(buffers);
+            return request(method, path, query, nullptr, &gatherOpts);
+        }
+
+        // no blocking request, callback is called when request done.
+        //   data and opts must valid until callback called.
+        //   callback may be called in the io thread, it should not block.
+        //   default implement request in the caller thread, then call callback.
+        virtual void requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback)
+        {
+            std::exception_ptr err;
+            GetResponse resp;
+            try
+            {
+                resp = request(method, path, query, data, opts);
+            }
+            catch (...)
+            {
+                err = std::current_exception();
+            }
+            if (callback)
+                callback(err, std::move(resp));
+        }
+
+        // same as requestAsync, the future get() throw the request exception.
+        std::future<GetResponse> requestFuture(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr)
+        {
+            auto prom = std::make_shared<std::promise<GetResponse>>();
+            auto fut = prom->get_future();
+            requestAsync(method, path, query, data, opts, [prom](std::exception_ptr err, GetResponse resp){
+                if (err)
+                    prom->set_exception(err);
+                else
+                    prom->set_value(std::move(resp));
+            });
+            return fut;
+        }
+
+        // false if not a pool.
+        virtual bool getPoolStats(PoolStats & /*stats*/) const { return false; }
+        // false if not supported.
+        virtual bool getTimingStats(TimingStats & /*stats*/) const { return false; }
 
         // stop only set stop flag, not sync stop request
         virtual void stop() = 0;
@@ -75,5 +377,10 @@ namespace ppeureka { namespace http { namespace impl {
     Client *create_client();
 
     // new client, need delete
-    Client *create_client_pool(std::size_t defaultConnCount=3, std::size_t maxConnCount=1000);
+    Client *create_client_pool(std::size_t defaultConnCount=3, std::size_t maxConnCount=1000, const PoolConfig &poolConfig = PoolConfig{});
+
+    // new client, need delete
+    // all async clients share one io thread driven by curl multi,
+    // requests are not blocking a thread each, see Client::requestAsync.
+    Client *create_client_async(std::size_t maxConnCount=1000);
 }}}
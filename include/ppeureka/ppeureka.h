@@ -12,3 +12,4 @@
 
 #include "ppeureka/eureka_connect.h"
 #include "ppeureka/eureka_agent.h"
+#include "ppeureka/registry_cache.h"
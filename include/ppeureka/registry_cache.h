@@ -0,0 +1,93 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "ppeureka/config.h"
+#include "ppeureka/error.h"
+#include "ppeureka/types.h"
+#include "ppeureka/eureka_connect.h"
+#include <mutex>
+#include <map>
+
+
+namespace ppeureka { namespace agent {
+
+    // local copy of the full registry, kept by delta as the eureka java client.
+    //   bootstrap from /eureka/apps, then apply /eureka/apps/delta and verify the apps hash code,
+    //   full fetch again when mismatch. so the traffic is in proportion to the churn rather than the fleet size.
+    //   thread safe, the returned instances are shared, do not modify them.
+    class RegistryCache
+    {
+        using lock_type = std::mutex;
+        using auto_lock_type = std::unique_lock<lock_type>;
+    public:
+        struct Stats
+        {
+            uint64_t        fullFetchCount{0};
+            uint64_t        deltaFetchCount{0};
+            uint64_t        hashMismatchCount{0};   // delta applied but not match the server, then full fetch
+            std::size_t     appCount{0};
+            std::size_t     insCount{0};
+            std::string     appsHashCode;
+        };
+
+        // conn must valid until the cache released.
+        explicit RegistryCache(EurekaConnect &conn) : m_conn(conn) {}
+
+        // full fetch if no data, else fetch the delta and apply.
+        //   if delta is disabled by server or hash code mismatch, full fetch.
+        // Exception:
+        //    see EurekaConnect, the data is kept, and the next refresh is full fetch if it may be inconsistent.
+        void refresh();
+        // full fetch if no data, else nothing. the concurrent callers share one fetch.
+        // Exception:
+        //    see EurekaConnect.
+        void bootstrap();
+        // clear the data, the next refresh is full fetch.
+        void reset();
+        bool hasData() const;
+
+        // instances in the cache, appId is case insensitive. empty if none.
+        InstanceInfoPtrDeque queryInsAll() const;
+        InstanceInfoPtrDeque queryInsByAppId(const std::string &appId) const;
+
+        Stats stats() const;
+
+        RegistryCache(const RegistryCache&) = delete;
+        RegistryCache& operator= (const RegistryCache&) = delete;
+
+    private:
+        using InstanceMap = std::map<std::string, InstanceInfoPtr>; // insId -> instance
+        using AppMap = std::map<std::string, InstanceMap>;          // upper app name -> instances
+        using StatusCounts = std::map<std::string, int64_t>;        // status -> instance count
+
+        void fullFetch();
+        static void addIns(InstanceMap &inses, StatusCounts &counts, const InstanceInfoPtr &ins);
+        static void eraseIns(InstanceMap &inses, StatusCounts &counts, const std::string &insId);
+        // locked
+        // Returns:
+        //   false if the hash code not match the server after applied.
+        bool applyDelta(const Applications &delta);
+        // "STATUS_count_" of every status in order, e.g. "DOWN_1_UP_5_", same as the server.
+        std::string hashCode() const;
+
+    private:
+        EurekaConnect                   &m_conn;
+        lock_type                       m_lockRefresh;  // one refresh at a time
+
+        mutable lock_type               m_lock;
+        bool                            m_hasData{false};
+        bool                            m_needFullFetch{false};
+        AppMap                          m_apps;
+        StatusCounts                    m_statusCounts;
+        std::string                     m_appsHashCode;
+        uint64_t                        m_fullFetchCount{0};
+        uint64_t                        m_deltaFetchCount{0};
+        uint64_t                        m_hashMismatchCount{0};
+    };
+
+}}
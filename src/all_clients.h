@@ -2,6 +2,7 @@
 
 #include "curl/http_client.h"
 #include "curl/http_client_pool.h"
+#include "curl/http_client_async.h"
 
 namespace ppeureka { namespace impl {
     using curl::HttpClient;
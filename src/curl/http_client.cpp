@@ -11,9 +11,9 @@
 #include <tuple>
 #include <cassert>
 #include <cstdlib>
+#include <cctype>
 #include <stdexcept>
-
-#include <regex>
+#include <mutex>
 
 #if (LIBCURL_VERSION_MAJOR < 7)
 #error "Where did you get such an ancient libcurl?"
@@ -25,6 +25,27 @@
 #define PPCONSUL_DISABLE_SSL_VERIFYSTATUS
 #endif
 
+// CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE was added in libcurl 7.49.0
+// https://curl.haxx.se/libcurl/c/CURLOPT_HTTP_VERSION.html
+#if (LIBCURL_VERSION_MAJOR == 7 && LIBCURL_VERSION_MINOR < 49)
+#define PPEUREKA_DISABLE_HTTP2
+#endif
+
+// CURLINFO_*_TIME_T was added in libcurl 7.61.0, CURLINFO_SIZE_*_T in 7.55.0
+// https://curl.haxx.se/libcurl/c/CURLINFO_TOTAL_TIME_T.html
+#if (LIBCURL_VERSION_NUM < 0x073d00)
+#define PPEUREKA_DISABLE_TIME_T_INFO
+#endif
+#if (LIBCURL_VERSION_NUM < 0x073700)
+#define PPEUREKA_DISABLE_SIZE_T_INFO
+#endif
+
+// CURLOPT_UNIX_SOCKET_PATH was added in libcurl 7.40.0
+// https://curl.haxx.se/libcurl/c/CURLOPT_UNIX_SOCKET_PATH.html
+#if (LIBCURL_VERSION_MAJOR == 7 && LIBCURL_VERSION_MINOR < 40)
+#define PPEUREKA_DISABLE_UNIX_SOCKET
+#endif
+
 
 namespace ppeureka { namespace curl {
 
@@ -52,25 +73,86 @@ namespace ppeureka { namespace curl {
             bool m_initialized;
         };
 
-#if !defined PPCONSUL_USE_BOOST_REGEX
-        using std::regex;
-        using std::regex_match;
-        using std::cmatch;
-#else
-        using boost::regex;
-        using boost::regex_match;
-        using boost::cmatch;
+        // share data between easy handles, locked by one mutex per data type.
+        class CurlShare
+        {
+        public:
+            enum {
+                SHARE_DNS = 1,
+                SHARE_TLS_SESSION = 2,
+                SHARE_CONNECTIONS = 4,
+                SHARE_MASK_COUNT = 8,
+            };
+
+            // the process shared object of the mask, nullptr if mask is 0.
+            static CURLSH *get(int mask)
+            {
+                static std::mutex s_lock;
+                static std::unique_ptr<CurlShare> s_shares[SHARE_MASK_COUNT];
+
+                if (mask <= 0 || mask >= SHARE_MASK_COUNT)
+                    return nullptr;
+
+                std::lock_guard<std::mutex> al{s_lock};
+                auto &share = s_shares[mask];
+                if (!share)
+                    share.reset(new CurlShare(mask));
+                return share->m_handle;
+            }
+
+            ~CurlShare()
+            {
+                if (m_handle)
+                    curl_share_cleanup(m_handle);
+            }
+
+            CurlShare(const CurlShare&) = delete;
+            CurlShare& operator= (const CurlShare&) = delete;
+
+        private:
+            explicit CurlShare(int mask)
+            {
+                m_handle = curl_share_init();
+                if (!m_handle)
+                    throw ppeureka::Error("CURL share handle creation failed");
+
+                curl_share_setopt(m_handle, CURLSHOPT_LOCKFUNC, &CurlShare::lockCallback);
+                curl_share_setopt(m_handle, CURLSHOPT_UNLOCKFUNC, &CurlShare::unlockCallback);
+                curl_share_setopt(m_handle, CURLSHOPT_USERDATA, this);
+
+                if (mask & SHARE_DNS)
+                    curl_share_setopt(m_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                if (mask & SHARE_TLS_SESSION)
+                    curl_share_setopt(m_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if (LIBCURL_VERSION_NUM >= 0x073900)
+                // CURL_LOCK_DATA_CONNECT was added in libcurl 7.57.0
+                if (mask & SHARE_CONNECTIONS)
+                    curl_share_setopt(m_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
 #endif
+            }
 
-        const regex g_statusLineRegex(R"***(HTTP\/1\.1 +(\d\d\d) +(.*)\r\n)***");
-        const regex g_headerLineRegex(R"***(([^:]+): +(.+)\r\n)***");
+            static void lockCallback(CURL *, curl_lock_data data, curl_lock_access, void *sharePtr)
+            {
+                static_cast<CurlShare *>(sharePtr)->m_locks[data % CURL_LOCK_DATA_LAST].lock();
+            }
+
+            static void unlockCallback(CURL *, curl_lock_data data, void *sharePtr)
+            {
+                static_cast<CurlShare *>(sharePtr)->m_locks[data % CURL_LOCK_DATA_LAST].unlock();
+            }
+
+            CURLSH      *m_handle{nullptr};
+            std::mutex  m_locks[CURL_LOCK_DATA_LAST];
+        };
 
         inline bool parseStatus(http::Status& status, const char *buf, size_t size)
         {
-            cmatch match;
-            if (!regex_match(buf, buf + size, match, g_statusLineRegex))
+            int code = 0;
+            const char *reason = nullptr;
+            size_t reasonLen = 0;
+            if (!parseStatusLine(buf, size, code, reason, reasonLen))
                 return false;
-            status = http::Status(std::atol(match[1].str().c_str()), match[2].str());
+            status = http::Status(code, std::string(reason, reasonLen));
             return true;
         }
 
@@ -78,6 +160,8 @@ namespace ppeureka { namespace curl {
         {
             if (code == CURLE_ABORTED_BY_CALLBACK)
                 throw ppeureka::OperationAborted();
+            else if (code == CURLE_OPERATION_TIMEDOUT)
+                throw ppeureka::TimeoutError(std::string(err) + " (" + std::to_string(code) + ")");
             else if (isNetError)
                 throw ppeureka::NetError(std::string(err) + " (" + std::to_string(code) + ")");
             else if (isParamError)
@@ -86,9 +170,12 @@ namespace ppeureka { namespace curl {
                 throw ppeureka::Error(std::string(err) + " (" + std::to_string(code) + ")");
         }
 
-        enum { Buffer_Size = 16384 };
+        enum {
+            Buffer_Size = 16384,
+            Recycle_Body_Size = 65536,
+        };
 
-        using ReadContext = std::pair<const std::string *, size_t>;
+        using ReadContext = detail::ReadContext;
 
         size_t headerStatusCallback(char *ptr, size_t size_, size_t nitems, void *outputStatus)
         {
@@ -97,58 +184,165 @@ namespace ppeureka { namespace curl {
             return size;
         }
 
-        size_t headerCallback(char *ptr, size_t size_, size_t nitems, void *outputResponse_)
+        inline bool equalsNoCase(const char *a, size_t aLen, const std::string &b)
+        {
+            if (aLen != b.size())
+                return false;
+            for (size_t i = 0; i < aLen; ++i)
+            {
+                if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+                    return false;
+            }
+            return true;
+        }
+
+        inline bool isHeaderWanted(const RequestOptions &opts, const char *name, size_t nameLen)
+        {
+            for (auto &&wanted : opts.headerNames)
+            {
+                if (equalsNoCase(name, nameLen, wanted))
+                    return true;
+            }
+            return false;
+        }
+
+        size_t headerCallback(char *ptr, size_t size_, size_t nitems, void *headerCtx)
         {
             const auto size = size_ * nitems;
-            auto outputResponse = reinterpret_cast<HttpClient::GetResponse *>(outputResponse_);
+            auto ctx = static_cast<detail::HeaderContext *>(headerCtx);
+            auto outputResponse = ctx->resp;
 
             if (parseStatus(std::get<0>(*outputResponse), ptr, size))
                 return size;
 
+            if (ctx->opts && RequestOptions::HEADERS_NONE == ctx->opts->headerCapture)
+                return size;
+
             // Parse headers
-            cmatch match;
-            if (!regex_match(const_cast<const char *>(ptr), const_cast<const char *>(ptr) +size, match, g_headerLineRegex))
+            const char *name = nullptr, *value = nullptr;
+            size_t nameLen = 0, valueLen = 0;
+            if (!parseHeaderLine(ptr, size, name, nameLen, value, valueLen))
+                return size;
+
+            if (ctx->opts && RequestOptions::HEADERS_NAMED == ctx->opts->headerCapture
+                && !isHeaderWanted(*ctx->opts, name, nameLen))
                 return size;
 
             ResponseHeaders& headers = std::get<1>(*outputResponse);
 
-            headers[match[1].str()] = match[2].str();
+            headers[std::string(name, nameLen)].assign(value, valueLen);
             return size;
         }
 
-        size_t writeCallback(char *ptr, size_t size_, size_t nitems, void *outputStr)
+        size_t writeCallback(char *ptr, size_t size_, size_t nitems, void *writeCtx)
         {
             const auto size = size_ * nitems;
-            static_cast<std::string *>(outputStr)->append(ptr, size);
-            return size;
+            auto ctx = static_cast<detail::WriteContext *>(writeCtx);
+            if (!ctx->consumer)
+            {
+                ctx->body->append(ptr, size);
+                return size;
+            }
+
+            // exception must not pass through curl, returning less than size aborts the transfer
+            try
+            {
+                if ((*ctx->consumer)(ptr, size))
+                    return size;
+                ctx->consumerAborted = true;
+            }
+            catch (...)
+            {
+                ctx->consumerErr = std::current_exception();
+            }
+            return 0;
         }
 
         size_t readCallback(char *buffer, size_t size_, size_t nitems, void *readContext)
         {
             const auto ctx = static_cast<ReadContext *>(readContext);
 
-            if (!ctx->first)
+            // fill the curl buffer from as many parts as fit
+            const auto bufferSize = size_ * nitems;
+            size_t size = 0;
+            while (size < bufferSize && ctx->index < ctx->count)
             {
-                return 0;
+                const auto &part = ctx->buffers[ctx->index];
+                const auto n = (std::min)(bufferSize - size, part.size - ctx->offset);
+                memcpy(buffer + size, part.data + ctx->offset, n);
+                size += n;
+                ctx->offset += n;
+                if (ctx->offset >= part.size)
+                {
+                    ++ctx->index;
+                    ctx->offset = 0;
+                }
             }
-
-            const auto remainingSize = ctx->first->size() - ctx->second;
-            if (!remainingSize)
-                return 0;
-
-            auto size = (std::min)(size_ * nitems, remainingSize);
-            memcpy(buffer, ctx->first->data() + ctx->second, size);
-            ctx->second += size;
             return size;
         }
 
         int progressCallback(void *clientPtr, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
         {
             const auto* client = static_cast<const HttpClient*>(clientPtr);
-            return client->isStopped();
+            return client->isAborted();
         }
     }
 
+    void detail::ReadContext::reset(const std::string *data, const RequestOptions *opts)
+    {
+        index = 0;
+        offset = 0;
+        if (data)
+        {
+            single = BodyBuffer{data->data(), data->size()};
+            buffers = &single;
+            count = 1;
+        }
+        else if (opts && !opts->bodyBuffers.empty())
+        {
+            buffers = opts->bodyBuffers.data();
+            count = opts->bodyBuffers.size();
+        }
+        else
+        {
+            buffers = nullptr;
+            count = 0;
+        }
+    }
+
+    size_t detail::ReadContext::totalSize() const
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < count; ++i)
+            size += buffers[i].size;
+        return size;
+    }
+
+    void detail::TimingAccumulator::add(const RequestTiming &timing)
+    {
+        const int64_t fields[FIELD_COUNT] = {timing.nameLookup, timing.connect, timing.appConnect, timing.preTransfer,
+            timing.startTransfer, timing.total, timing.uploadBytes, timing.downloadBytes};
+        for (int i = 0; i < FIELD_COUNT; ++i)
+            m_sums[i].fetch_add(fields[i], std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void detail::TimingAccumulator::get(TimingStats &stats) const
+    {
+        stats.count = m_count.load(std::memory_order_relaxed);
+        auto &sum = stats.sum;
+        int64_t *fields[FIELD_COUNT] = {&sum.nameLookup, &sum.connect, &sum.appConnect, &sum.preTransfer,
+            &sum.startTransfer, &sum.total, &sum.uploadBytes, &sum.downloadBytes};
+        for (int i = 0; i < FIELD_COUNT; ++i)
+            *fields[i] = m_sums[i].load(std::memory_order_relaxed);
+    }
+
+    bool detail::curlInitialized()
+    {
+        static const CurlInitializer g_initialized;
+        return static_cast<bool>(g_initialized);
+    }
+
     void HttpClient::setupTls(const TlsConfig& tlsConfig)
     {
         if (!tlsConfig.cert.empty())
@@ -180,13 +374,77 @@ namespace ppeureka { namespace curl {
         }
     }
 
-    HttpClient::~HttpClient() = default;
+    void HttpClient::setupTransport(const TransportConfig& transportConfig)
+    {
+        int shareMask = 0;
+        if (transportConfig.shareDns)
+            shareMask |= CurlShare::SHARE_DNS;
+        if (transportConfig.shareTlsSession)
+            shareMask |= CurlShare::SHARE_TLS_SESSION;
+        if (transportConfig.shareConnections)
+            shareMask |= CurlShare::SHARE_CONNECTIONS;
+
+        if (auto share = CurlShare::get(shareMask))
+            setopt(CURLOPT_SHARE, share);
+
+        if (transportConfig.maxConnects > 0)
+            setopt(CURLOPT_MAXCONNECTS, transportConfig.maxConnects);
+
+        setopt(CURLOPT_TCP_NODELAY, transportConfig.tcpNoDelay ? 1l : 0l);
+        if (transportConfig.tcpKeepAlive)
+        {
+            setopt(CURLOPT_TCP_KEEPALIVE, 1l);
+            setopt(CURLOPT_TCP_KEEPIDLE, static_cast<long>(transportConfig.tcpKeepIdle.count()));
+            setopt(CURLOPT_TCP_KEEPINTVL, static_cast<long>(transportConfig.tcpKeepInterval.count()));
+        }
+        if (!transportConfig.localInterface.empty())
+            setopt(CURLOPT_INTERFACE, transportConfig.localInterface.c_str());
+        if (!transportConfig.unixSocketPath.empty())
+        {
+#ifdef PPEUREKA_DISABLE_UNIX_SOCKET
+            throw ppeureka::Error("ppeureka was built without support for CURLOPT_UNIX_SOCKET_PATH");
+#else
+            setopt(CURLOPT_UNIX_SOCKET_PATH, transportConfig.unixSocketPath.c_str());
+#endif
+        }
+
+        if (!transportConfig.acceptEncoding.empty())
+        {
+            static const bool s_hasZlib = 0 != (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_LIBZ);
+            if (s_hasZlib)
+                setopt(CURLOPT_ACCEPT_ENCODING, transportConfig.acceptEncoding.c_str());
+        }
+
+        switch (transportConfig.httpVersion)
+        {
+        case HTTP_VERSION_1_1:
+            setopt(CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_1_1));
+            break;
+        case HTTP_VERSION_2:
+        case HTTP_VERSION_2_PRIOR_KNOWLEDGE:
+#ifdef PPEUREKA_DISABLE_HTTP2
+            throw ppeureka::Error("ppeureka was built without support for CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE");
+#else
+            setopt(CURLOPT_HTTP_VERSION, static_cast<long>(HTTP_VERSION_2 == transportConfig.httpVersion
+                ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE));
+            // wait for a connection can be multiplexed rather than open a new one
+            setopt(CURLOPT_PIPEWAIT, 1l);
+#endif
+            break;
+        default:
+            break;
+        }
+    }
 
-    void HttpClient::start(const std::string& endpoint, const TlsConfig& tlsConfig)
+    HttpClient::~HttpClient()
     {
-        static const CurlInitializer g_initialized;
+        if (m_headers)
+            curl_slist_free_all(m_headers);
+    }
 
-        if (!g_initialized)
+    void HttpClient::start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig)
+    {
+        if (!detail::curlInitialized())
             throw ppeureka::Error("CURL was not successfully initialized");
 
         m_handle.reset(curl_easy_init());
@@ -210,11 +468,32 @@ namespace ppeureka { namespace curl {
         //throw ppeureka::Error("Ppconsul is built without support for stopping the client (libcurl 7.32.0 or newer is required)");
 #endif
 
-        // TODO: CURLOPT_NOSIGNAL?
+        // timeouts must not use signals in multi-threaded process
+        setopt(CURLOPT_NOSIGNAL, 1l);
         setopt(CURLOPT_WRITEFUNCTION, &writeCallback);
         setopt(CURLOPT_READFUNCTION, &readCallback);
 
+        // the request state is in members, so the data pointers are set once.
+        m_body.reserve(Buffer_Size);
+        m_headerCtx.resp = &m_resp;
+        m_writeCtx.body = &m_body;
+        setopt(CURLOPT_HEADERFUNCTION, &headerCallback);
+        setopt(CURLOPT_HEADERDATA, &m_headerCtx);
+        setopt(CURLOPT_WRITEDATA, &m_writeCtx);
+        setopt(CURLOPT_READDATA, &m_readCtx);
+
+        // set json only
+        if (m_headers)
+            curl_slist_free_all(m_headers);
+        m_headers = nullptr;
+        m_headers = curl_slist_append(m_headers, "accept: application/json");
+        m_headers = curl_slist_append(m_headers, "content-type: application/json");
+        setopt(CURLOPT_HTTPHEADER, m_headers);
+        m_lastMethod = -1;
+        m_lastLimits = detail::RequestLimits{};
+
         setupTls(tlsConfig);
+        setupTransport(transportConfig);
     }
 
     void HttpClient::setEndpoint(const std::string &endpoint)
@@ -224,26 +503,46 @@ namespace ppeureka { namespace curl {
         m_endpoint = endpoint;
     }
 
-    HttpClient::GetResponse HttpClient::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data)
+    HttpClient::GetResponse HttpClient::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts)
+    {
+        auto al = get_lock_request();
+
+        prepareRequest(method, path, query, data, opts);
+        return completeRequest(curl_easy_perform(handle()));
+    }
+
+    void HttpClient::prepareRequest(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts)
     {
-        std::string url;
+        m_cancelToken = opts ? opts->cancelToken.get() : nullptr;
+        if (m_cancelToken && m_cancelToken->isCancelled())
+        {
+            m_cancelToken = nullptr;
+            throw ppeureka::OperationAborted();
+        }
+
         {
             auto al = get_lock_param();
-            url = makeUrl(path, query);
+            makeUrl(m_url, path, query);
         }
-        auto al = get_lock_request();
 
-        GetResponse r;
-        std::get<2>(r).reserve(Buffer_Size);
+        m_resp = GetResponse{};
+        m_body.clear();
 
-        ReadContext ctx(data, 0u);
+        m_readCtx.reset(data, opts);
+        m_headerCtx.opts = opts;
+        m_writeCtx.consumer = (opts && opts->bodyConsumer) ? &opts->bodyConsumer : nullptr;
+        m_writeCtx.consumerAborted = false;
+        m_writeCtx.consumerErr = nullptr;
 
-        setopt(CURLOPT_HEADERFUNCTION, &headerCallback);
-        setopt(CURLOPT_CUSTOMREQUEST, nullptr);
-        setopt(CURLOPT_URL, url.c_str());
-        setopt(CURLOPT_WRITEDATA, &std::get<2>(r));
-        setopt(CURLOPT_HEADERDATA, &r);
+        setopt(CURLOPT_URL, m_url.c_str());
 
+        const curl_off_t dataSize = static_cast<curl_off_t>(m_readCtx.totalSize());
+        if (METHOD_PUT == m_lastMethod && METHOD_PUT != method)
+        {
+            // else the next request is sent as upload, reset before the method options which may depend on it
+            setopt(CURLOPT_UPLOAD, 0l);
+            setopt(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(-1));
+        }
         if (METHOD_GET == method)
         {
             setopt(CURLOPT_HTTPGET, 1l);
@@ -251,43 +550,172 @@ namespace ppeureka { namespace curl {
         else if (METHOD_POST == method)
         {
             setopt(CURLOPT_POST, 1l);
-            if (data)
+            setopt(CURLOPT_POSTFIELDSIZE_LARGE, dataSize);
+            // a contiguous body is sent from the caller memory, others by readCallback
+            if (1 == m_readCtx.count)
             {
-                setopt(CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(data->size()));
+                setopt(CURLOPT_POSTFIELDS, m_readCtx.buffers[0].data);
+                m_postFieldsSet = true;
             }
-            else
+            else if (m_postFieldsSet)
             {
-                setopt(CURLOPT_POSTFIELDSIZE_LARGE, 0);
+                setopt(CURLOPT_POSTFIELDS, static_cast<const char *>(nullptr));
+                m_postFieldsSet = false;
             }
-            setopt(CURLOPT_READDATA, &ctx);
         }
         else if (METHOD_PUT == method)
         {
             setopt(CURLOPT_UPLOAD, 1l);
-            setopt(CURLOPT_PUT, 1l);
-            if (data)
-            {
-                setopt(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(data->size()));
-            }
-            else
-            {
-                setopt(CURLOPT_POSTFIELDSIZE_LARGE, 0);
-            }
-            setopt(CURLOPT_READDATA, &ctx);
+            setopt(CURLOPT_INFILESIZE_LARGE, dataSize);
         }
         else if (METHOD_DELETE == method)
         {
             setopt(CURLOPT_HTTPGET, 1l);
-            setopt(CURLOPT_CUSTOMREQUEST, "DELETE");
+        }
+        else if (METHOD_HEAD == method)
+        {
+            setopt(CURLOPT_NOBODY, 1l);
         }
         else
         {
             throw ppeureka::Error("not supported method");
         }
 
-        perform();
+        if (method != m_lastMethod)
+        {
+            setopt(CURLOPT_CUSTOMREQUEST, METHOD_DELETE == method ? "DELETE" : nullptr);
+            if (METHOD_HEAD == m_lastMethod)
+                setopt(CURLOPT_NOBODY, 0l);
+            m_lastMethod = method;
+        }
+
+        setupLimits(opts);
+    }
+
+    void HttpClient::setupLimits(const RequestOptions *opts)
+    {
+        detail::RequestLimits limits;
+        if (opts)
+        {
+            limits.connectTimeoutMs = static_cast<long>(opts->connectTimeout.count());
+            limits.timeoutMs = static_cast<long>(opts->timeout.count());
+            limits.lowSpeedLimit = opts->lowSpeedLimit;
+            limits.lowSpeedTime = static_cast<long>(opts->lowSpeedTime.count());
+        }
+
+        // options keep in handle, only set when changed
+        if (limits.connectTimeoutMs != m_lastLimits.connectTimeoutMs)
+            setopt(CURLOPT_CONNECTTIMEOUT_MS, limits.connectTimeoutMs);
+        if (limits.timeoutMs != m_lastLimits.timeoutMs)
+            setopt(CURLOPT_TIMEOUT_MS, limits.timeoutMs);
+        if (limits.lowSpeedLimit != m_lastLimits.lowSpeedLimit)
+            setopt(CURLOPT_LOW_SPEED_LIMIT, limits.lowSpeedLimit);
+        if (limits.lowSpeedTime != m_lastLimits.lowSpeedTime)
+            setopt(CURLOPT_LOW_SPEED_TIME, limits.lowSpeedTime);
+        m_lastLimits = limits;
+    }
+
+    void HttpClient::addTiming()
+    {
+        RequestTiming timing;
+#ifdef PPEUREKA_DISABLE_TIME_T_INFO
+        const std::pair<CURLINFO, int64_t *> times[] = {
+            {CURLINFO_NAMELOOKUP_TIME, &timing.nameLookup}, {CURLINFO_CONNECT_TIME, &timing.connect},
+            {CURLINFO_APPCONNECT_TIME, &timing.appConnect}, {CURLINFO_PRETRANSFER_TIME, &timing.preTransfer},
+            {CURLINFO_STARTTRANSFER_TIME, &timing.startTransfer}, {CURLINFO_TOTAL_TIME, &timing.total},
+        };
+        for (auto &&t : times)
+        {
+            double seconds = 0;
+            if (CURLE_OK == curl_easy_getinfo(handle(), t.first, &seconds))
+                *t.second = static_cast<int64_t>(seconds * 1000000);
+        }
+#else
+        const std::pair<CURLINFO, int64_t *> times[] = {
+            {CURLINFO_NAMELOOKUP_TIME_T, &timing.nameLookup}, {CURLINFO_CONNECT_TIME_T, &timing.connect},
+            {CURLINFO_APPCONNECT_TIME_T, &timing.appConnect}, {CURLINFO_PRETRANSFER_TIME_T, &timing.preTransfer},
+            {CURLINFO_STARTTRANSFER_TIME_T, &timing.startTransfer}, {CURLINFO_TOTAL_TIME_T, &timing.total},
+        };
+        for (auto &&t : times)
+        {
+            curl_off_t us = 0;
+            if (CURLE_OK == curl_easy_getinfo(handle(), t.first, &us))
+                *t.second = static_cast<int64_t>(us);
+        }
+#endif
+
+#ifdef PPEUREKA_DISABLE_SIZE_T_INFO
+        double upload = 0, download = 0;
+        curl_easy_getinfo(handle(), CURLINFO_SIZE_UPLOAD, &upload);
+        curl_easy_getinfo(handle(), CURLINFO_SIZE_DOWNLOAD, &download);
+#else
+        curl_off_t upload = 0, download = 0;
+        curl_easy_getinfo(handle(), CURLINFO_SIZE_UPLOAD_T, &upload);
+        curl_easy_getinfo(handle(), CURLINFO_SIZE_DOWNLOAD_T, &download);
+#endif
+        timing.uploadBytes = static_cast<int64_t>(upload);
+        timing.downloadBytes = static_cast<int64_t>(download);
 
-        return r;
+        m_timing.add(timing);
+        if (m_timingSink)
+            m_timingSink->add(timing);
+    }
+
+    void HttpClient::watchCancel(const std::function<void()> &wake)
+    {
+        for (auto token = m_cancelToken; token; token = token->parent().get())
+        {
+            if (auto id = token->addCancelHook(wake))
+                m_cancelHooks.emplace_back(token, id);
+        }
+    }
+
+    void HttpClient::unwatchCancel()
+    {
+        for (auto &&st : m_cancelHooks)
+        {
+            st.first->removeCancelHook(st.second);
+        }
+        m_cancelHooks.clear();
+    }
+
+    HttpClient::GetResponse HttpClient::completeRequest(CURLcode err)
+    {
+        addTiming();
+
+        m_readCtx.reset(nullptr, nullptr);
+        m_headerCtx.opts = nullptr;
+        m_writeCtx.consumer = nullptr;
+        unwatchCancel();
+        m_cancelToken = nullptr;
+
+        if (m_writeCtx.consumerErr)
+        {
+            auto consumerErr = m_writeCtx.consumerErr;
+            m_writeCtx.consumerErr = nullptr;
+            std::rethrow_exception(consumerErr);
+        }
+        if (m_writeCtx.consumerAborted)
+            throw ppeureka::OperationAborted();
+        if (err)
+            throwCurlError(err, m_errBuffer, true, false);
+
+        // small body is copied out and the buffer is kept for next request,
+        // big body is moved out to avoid copy and to release the memory.
+        auto &body = std::get<2>(m_resp);
+        if (m_body.size() <= Recycle_Body_Size)
+        {
+            body.assign(m_body.data(), m_body.size());
+        }
+        else
+        {
+            body = std::move(m_body);
+            m_body = std::string{};
+            m_body.reserve(Buffer_Size);
+        }
+        m_body.clear();
+
+        return std::move(m_resp);
     }
 
     void HttpClient::stop()
@@ -305,20 +733,4 @@ namespace ppeureka { namespace curl {
             throwCurlError(err, m_errBuffer, false, true);
     }
 
-    inline void HttpClient::perform()
-    {
-        // set json only
-        struct curl_slist *headers = nullptr;
-        headers = curl_slist_append(headers, "accept: application/json");
-        headers = curl_slist_append(headers, "content-type: application/json");
-        setopt(CURLOPT_HTTPHEADER, headers);
-
-        const auto err = curl_easy_perform(handle());
-        curl_slist_free_all(headers);
-        headers = nullptr;
-
-        if (err)
-            throwCurlError(err, m_errBuffer, true, false);
-    }
-
 }}
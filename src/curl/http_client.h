@@ -12,6 +12,9 @@
 #include <memory>
 #include <atomic>
 #include <mutex>
+#include <vector>
+#include <functional>
+#include <cstdint>
 
 
 namespace ppeureka { namespace curl {
@@ -25,14 +28,70 @@ namespace ppeureka { namespace curl {
                 curl_easy_cleanup(handle);
             }
         };
+
+        // curl global init once, return false if init fail.
+        bool curlInitialized();
+
+        // the body parts and read position
+        struct ReadContext
+        {
+            const ppeureka::http::impl::BodyBuffer *buffers{nullptr};
+            size_t count{0};
+            size_t index{0};
+            size_t offset{0};
+            ppeureka::http::impl::BodyBuffer single{nullptr, 0}; // the part of std::string body
+
+            void reset(const std::string *data, const ppeureka::http::impl::RequestOptions *opts);
+            size_t totalSize() const;
+        };
+
+        struct RequestLimits
+        {
+            long connectTimeoutMs{0};
+            long timeoutMs{0};
+            long lowSpeedLimit{0};
+            long lowSpeedTime{0};
+        };
+
+        struct HeaderContext
+        {
+            ppeureka::http::impl::Client::GetResponse *resp{nullptr};
+            const ppeureka::http::impl::RequestOptions *opts{nullptr};
+        };
+
+        // request timings added by many threads.
+        class TimingAccumulator
+        {
+        public:
+            void add(const ppeureka::http::impl::RequestTiming &timing);
+            void get(ppeureka::http::impl::TimingStats &stats) const;
+
+        private:
+            enum { FIELD_COUNT = 8 };
+            std::atomic<uint64_t> m_count{0};
+            std::atomic<int64_t>  m_sums[FIELD_COUNT] = {};
+        };
+
+        struct WriteContext
+        {
+            std::string *body{nullptr};
+            const ppeureka::http::impl::BodyConsumer *consumer{nullptr};
+            bool consumerAborted{false};
+            std::exception_ptr consumerErr;
+        };
     }
 
+    class AsyncHttpClient;
+
     class HttpClient: public ppeureka::http::impl::Client
     {
     public:
         using GetResponse = std::tuple<http::Status, ResponseHeaders, std::string>;
         using TlsConfig = ppeureka::http::impl::TlsConfig;
+        using TransportConfig = ppeureka::http::impl::TransportConfig;
         using HttpMethod = ppeureka::http::impl::HttpMethod;
+        using RequestOptions = ppeureka::http::impl::RequestOptions;
+        using TimingStats = ppeureka::http::impl::TimingStats;
 
         using lock_type = std::mutex;
         using auto_lock_type = std::unique_lock<lock_type>;
@@ -42,12 +101,18 @@ namespace ppeureka { namespace curl {
         // == Client interface ==
         virtual ~HttpClient() override;
         void setEndpoint(const std::string &endpoint) override;
-        void start(const std::string& endpoint, const TlsConfig& tlsConfig) override;
-        GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr) override;
+        void start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig = TransportConfig{}) override;
+        GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr) override;
         void stop() override;
+        bool getTimingStats(TimingStats &stats) const override { m_timing.get(stats); return true; }
         // == Client interface ==
 
+        // the request timings are also added to sink, e.g. of the owner pool. set before request.
+        void setTimingSink(detail::TimingAccumulator *sink) { m_timingSink = sink; }
+
         bool isStopped() const { return m_stopped.load(std::memory_order_relaxed); }
+        // stopped or the current request cancelled
+        bool isAborted() const { return isStopped() || (m_cancelToken && m_cancelToken->isCancelled()); }
 
         HttpClient(const HttpClient&) = delete;
         HttpClient(HttpClient&&) = delete;
@@ -55,7 +120,22 @@ namespace ppeureka { namespace curl {
         HttpClient& operator= (HttpClient&&) = delete;
 
     private:
+        friend class AsyncHttpClient;
+        friend class HttpClientPool;
+
+        // setup options and state of one request, then the handle can be performed by easy or multi.
+        void prepareRequest(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts);
+        // take the response of the request performed, throw if err.
+        GetResponse completeRequest(CURLcode err);
+        // call wake when the token of the prepared request or its parents cancelled, removed by completeRequest.
+        //   the progress callback is not called by a stalled transfer in engine, it is woken to abort.
+        void watchCancel(const std::function<void()> &wake);
+        void unwatchCancel();
+
         void setupTls(const ppeureka::http::impl::TlsConfig& tlsConfig);
+        void setupTransport(const ppeureka::http::impl::TransportConfig& transportConfig);
+        void setupLimits(const RequestOptions *opts);
+        void addTiming();
 
         auto_lock_type get_lock_param() const { return auto_lock_type{m_lock_param}; }
         auto_lock_type get_lock_request() const { return auto_lock_type{m_lock_request}; }
@@ -63,17 +143,31 @@ namespace ppeureka { namespace curl {
         template<class Opt, class T>
         void setopt(Opt opt, const T& t);
 
-        std::string makeUrl(const std::string& path, const std::string& query) const { return ppeureka::http::impl::makeUrl(m_endpoint, path, query); }
+        void makeUrl(std::string &url, const std::string& path, const std::string& query) const { ppeureka::http::impl::makeUrl(url, m_endpoint, path, query); }
 
         CURL *handle() const PPEUREKA_NOEXCEPT { return m_handle.get(); }
 
-        void perform();
-
         mutable lock_type  m_lock_request;
         mutable lock_type  m_lock_param;
         std::string m_endpoint;
         std::unique_ptr<CURL, detail::CurlEasyDeleter> m_handle;
         char m_errBuffer[CURL_ERROR_SIZE]; // Replace with unique_ptr<std::array<char, CURL_ERROR_SIZE>> if moving is needed
+        // static headers, set once at start
+        struct curl_slist *m_headers{nullptr};
+        // state of the current request, reused by every request
+        int         m_lastMethod{-1};
+        detail::RequestLimits m_lastLimits;
+        std::string m_url;
+        std::string m_body;
+        GetResponse m_resp;
+        detail::ReadContext m_readCtx;
+        bool m_postFieldsSet{false};
+        detail::HeaderContext m_headerCtx;
+        detail::WriteContext m_writeCtx;
+        const ppeureka::http::impl::CancelToken *m_cancelToken{nullptr};
+        std::vector<std::pair<const ppeureka::http::impl::CancelToken *, uint64_t>> m_cancelHooks;
+        detail::TimingAccumulator m_timing;
+        detail::TimingAccumulator *m_timingSink{nullptr};
         bool m_enableStop{true};
         std::atomic_bool m_stopped{false};
     };
@@ -0,0 +1,215 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include "http_client_async.h"
+#include "ppeureka/helpers.h"
+#include <cassert>
+#include <vector>
+
+namespace ppeureka { namespace curl {
+
+    using namespace ppeureka::http::impl;
+
+    AsyncHttpClient::~AsyncHttpClient()
+    {
+        stop();
+    }
+
+    void AsyncHttpClient::start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig)
+    {
+        auto engine = HttpEngine::shared();
+
+        m_stopped = false;
+
+        auto al = get_lock();
+        m_engine = std::move(engine);
+        m_endpoint = endpoint;
+        m_tls = tlsConfig;
+        m_transport = transportConfig;
+    }
+
+    void AsyncHttpClient::setEndpoint(const std::string &endpoint)
+    {
+        auto al = get_lock();
+        m_endpoint = endpoint;
+
+        for (auto &&cli : m_pool)
+        {
+            cli->setEndpoint(endpoint);
+        }
+        for (auto &&cli : m_using)
+        {
+            cli->setEndpoint(endpoint);
+        }
+    }
+
+    AsyncHttpClient::GetResponse AsyncHttpClient::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts)
+    {
+        // the request is transfered by io thread, wait in it blocks all others for ever
+        if (m_engine && m_engine->isIoThread())
+            throw Error("blocking request in io thread");
+
+        return requestFuture(method, path, query, data, opts).get();
+    }
+
+    void AsyncHttpClient::requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback)
+    {
+        HttpClientPtr cli;
+        bool counted = false;
+        try
+        {
+            {
+                // counted with the stopped check, so stop either waits it or it fails
+                auto al = get_lock();
+                if (isStopped() || !m_engine)
+                    throw Error("stoped");
+                ++m_requesting_count;
+                counted = true;
+            }
+
+            cli = getClient();
+            cli->prepareRequest(method, path, query, data, opts);
+        }
+        catch (...)
+        {
+            if (cli)
+                freeClient(cli);
+            if (counted)
+                onRequestDone();
+            if (callback)
+                callback(std::current_exception(), GetResponse{});
+            return;
+        }
+
+        std::weak_ptr<HttpEngine> weakEngine = m_engine;
+        cli->watchCancel([weakEngine](){
+            if (auto engine = weakEngine.lock())
+                engine->abortCancelled();
+        });
+        auto rawCli = cli.get();
+        m_engine->add(cli->handle(), [this, cli, callback](CURLcode err){
+            std::exception_ptr ep;
+            GetResponse resp;
+            try
+            {
+                resp = cli->completeRequest(err);
+            }
+            catch (...)
+            {
+                ep = std::current_exception();
+            }
+            // this may be released by stop once done, so not used after
+            freeClient(cli);
+            onRequestDone();
+
+            if (callback)
+            {
+                try
+                {
+                    callback(ep, std::move(resp));
+                }
+                catch (...)
+                {
+                    // TODO trace it
+                }
+            }
+        }, [rawCli](){
+            return rawCli->isAborted();
+        });
+    }
+
+    void AsyncHttpClient::stop()
+    {
+        m_stopped = true;
+
+        auto al = get_lock();
+        for (auto &&cli : m_pool)
+        {
+            cli->stop();
+        }
+        for (auto &&cli : m_using)
+        {
+            cli->stop();
+        }
+
+        // wait requesting 0, the aborted requests done soon.
+        //   they are done by io thread, so remove them from the engine if in it.
+        if (m_engine && m_engine->isIoThread())
+        {
+            while (0 != m_requesting_count)
+            {
+                std::vector<CURL *> handles;
+                for (auto &&cli : m_using)
+                {
+                    handles.emplace_back(cli->handle());
+                }
+                al.unlock();
+                for (auto &&handle : handles)
+                {
+                    m_engine->remove(handle);
+                }
+                al.lock();
+                // others may add one before stopped seen
+                m_doneWait.wait_for(al, std::chrono::milliseconds{10}, [this](){
+                    return 0 == m_requesting_count;
+                });
+            }
+        }
+        else
+        {
+            // a stalled transfer does not see stopped by the progress callback
+            if (m_engine)
+                m_engine->abortCancelled();
+            m_doneWait.wait(al, [this](){
+                return 0 == m_requesting_count;
+            });
+        }
+
+        m_pool.clear();
+        m_using.clear();
+    }
+
+    AsyncHttpClient::HttpClientPtr AsyncHttpClient::getClient()
+    {
+        auto al = get_lock();
+        if (m_pool.empty())
+        {
+            if (m_using.size() >= m_maxConnCount)
+                throw Error("limit to max conn count");
+
+            auto cli = std::make_shared<HttpClient>();
+            cli->setTimingSink(&m_timing);
+            cli->start(m_endpoint, m_tls, m_transport);
+            m_pool.emplace_back(cli);
+        }
+        auto cli = m_pool.front();
+        m_pool.pop_front();
+
+        m_using.emplace(cli);
+        return cli;
+    }
+
+    void AsyncHttpClient::freeClient(const HttpClientPtr &cli)
+    {
+        auto al = get_lock();
+        auto it = m_using.find(cli);
+        if (it == m_using.end())
+            return; // cleared by stop
+        m_using.erase(it);
+
+        if (!isStopped())
+            m_pool.emplace_front(cli);
+    }
+
+    void AsyncHttpClient::onRequestDone()
+    {
+        auto al = get_lock();
+        assert(m_requesting_count > 0);
+        if (--m_requesting_count == 0)
+            m_doneWait.notify_all();
+    }
+
+}}
@@ -0,0 +1,87 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <ppeureka/http_client.h>
+#include "http_client.h"
+#include "http_engine.h"
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <set>
+
+namespace ppeureka { namespace curl {
+
+    // requests are transfered by the shared HttpEngine, so no thread is blocked by each request.
+    //   every in-flight request use one easy handle, idle handles are reused.
+    class AsyncHttpClient: public ppeureka::http::impl::Client
+    {
+        using HttpClientPtr = std::shared_ptr<HttpClient>;
+
+    public:
+        using GetResponse = std::tuple<http::Status, ResponseHeaders, std::string>;
+        using TlsConfig = ppeureka::http::impl::TlsConfig;
+        using TransportConfig = ppeureka::http::impl::TransportConfig;
+        using HttpMethod = ppeureka::http::impl::HttpMethod;
+        using RequestOptions = ppeureka::http::impl::RequestOptions;
+        using TimingStats = ppeureka::http::impl::TimingStats;
+
+        using lock_type = std::mutex;
+        using auto_lock_type = std::unique_lock<lock_type>;
+
+        explicit AsyncHttpClient(std::size_t maxConnCount)
+            : m_maxConnCount(maxConnCount) {
+        }
+
+        // == Client interface ==
+        virtual ~AsyncHttpClient() override;
+        void setEndpoint(const std::string &endpoint) override;
+        void start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig = TransportConfig{}) override;
+        // block until done, the request is still transfered by io thread.
+        // Exception:
+        //    ppeureka::Error if called in io thread, use requestAsync there.
+        GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr) override;
+        void requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback) override;
+        // set stop flag, and wait all request end. the requests are aborted at once if called in io thread.
+        void stop() override;
+        bool getTimingStats(TimingStats &stats) const override { m_timing.get(stats); return true; }
+        // == Client interface ==
+
+        bool isStopped() const { return m_stopped.load(std::memory_order_relaxed); }
+
+        AsyncHttpClient(const AsyncHttpClient&) = delete;
+        AsyncHttpClient(AsyncHttpClient&&) = delete;
+        AsyncHttpClient& operator= (const AsyncHttpClient&) = delete;
+        AsyncHttpClient& operator= (AsyncHttpClient&&) = delete;
+
+    private:
+        auto_lock_type get_lock() const { return auto_lock_type{m_lock}; }
+
+        HttpClientPtr getClient();
+        void freeClient(const HttpClientPtr &cli);
+        void onRequestDone();
+
+        std::atomic_bool m_stopped{false};
+        std::size_t      m_maxConnCount{1000};
+
+        std::shared_ptr<HttpEngine> m_engine;
+
+        mutable lock_type        m_lock;
+        std::condition_variable  m_doneWait;
+        std::string              m_endpoint;
+        TlsConfig                m_tls;
+        TransportConfig          m_transport;
+
+        std::size_t              m_requesting_count{0};
+        std::list<HttpClientPtr> m_pool;
+        std::set<HttpClientPtr>  m_using;
+        detail::TimingAccumulator m_timing;    // of all clients
+    };
+
+}}
@@ -11,7 +11,9 @@
 #include <functional>
 #include <thread>
 #include <algorithm>
-#include <map>
+#include <set>
+#include <vector>
+#include <cmath>
 #include "ppeureka/helpers.h"
 
 namespace {
@@ -19,10 +21,9 @@ namespace {
     using DeferRun = ppeureka::helpers::DeferRun;
 
     // all HttpClientPool use one timer thread to free empty client
+    //   the thread sleeps on a condition variable, and runs only when the period gone or stopped.
     class PoolGlobalTimerThread
     {
-        using CheckFlag = std::atomic<bool>;
-        using CheckFlagPtr = std::shared_ptr<CheckFlag>;
     public:
         void incStart(HttpClientPool *poolIns)
         {
@@ -31,25 +32,19 @@ namespace {
                 assert(poolIns);
                 return;
             }
-            bool hasAdd{false};
+
+            std::lock_guard<std::mutex> alThread{m_lockThread};
             {
                 std::lock_guard<std::mutex> al{m_lock};
-                auto it = m_runPools.find(poolIns);
-                if (it == m_runPools.end())
-                {
-                    hasAdd = true;
-                    m_runPools.emplace(poolIns, std::make_shared<CheckFlag>(false));
-                }
-            }
-            if (!hasAdd)
-                return;
-            if (++m_count == 1)
-            {
+                if (!m_runPools.insert(poolIns).second)
+                    return;
+                if (m_runPools.size() != 1)
+                    return;
                 m_stop_flag = false;
-                m_timer_thread = std::thread([this](){
-                    doTimer();
-                });
             }
+            m_timer_thread = std::thread([this](){
+                doTimer();
+            });
         }
 
         void decStop(HttpClientPool *poolIns)
@@ -60,84 +55,68 @@ namespace {
                 return;
             }
 
-            CheckFlagPtr cfPtr;
+            std::lock_guard<std::mutex> alThread{m_lockThread};
             {
-                std::lock_guard<std::mutex> al{m_lock};
-                auto it = m_runPools.find(poolIns);
-                if (it != m_runPools.end())
-                {
-                    cfPtr = it->second;
-                    m_runPools.erase(poolIns);
-                }
-            }
-            if (!cfPtr)
-                return;
-            while (*cfPtr)
-            {
-                // wait clear check flag
-                std::this_thread::sleep_for(std::chrono::milliseconds{1});
-            }
-            if (--m_count == 0)
-            {
-                assert(m_runPools.empty());
+                std::unique_lock<std::mutex> al{m_lock};
+                if (0 == m_runPools.erase(poolIns))
+                    return;
+                // wait the check of the pool end
+                m_cv.wait(al, [this, poolIns](){
+                    return m_checkingPool != poolIns;
+                });
+                if (!m_runPools.empty())
+                    return;
                 m_stop_flag = true;
-                m_timer_thread.join();
             }
+            m_cv.notify_all();
+            m_timer_thread.join();
         }
 
     private:
         void doTimer()
         {
+            std::unique_lock<std::mutex> al{m_lock};
             while (true)
             {
-                int i = 0;
-                while (i++ < 30*100 && !m_stop_flag)
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds{10});
-                }
+                m_cv.wait_for(al, std::chrono::seconds{30}, [this](){
+                    return m_stop_flag;
+                });
                 if (m_stop_flag)
                 {
                     break;
                 }
 
-                checkReleaseClient();
+                checkReleaseClient(al);
             }
         }
-        void checkReleaseClient()
+        void checkReleaseClient(std::unique_lock<std::mutex> &al)
         {
-            decltype(m_runPools) curChecks;
+            // the pool removed while checking others is skipped
+            auto curChecks = m_runPools;
+            for (auto &&poolIns : curChecks)
             {
-                std::lock_guard<std::mutex> al{m_lock};
-                for (auto &&st : m_runPools)
-                {
-                    auto &cf = st.second;
-                    *cf = true; // set check flag
-                    curChecks.emplace(st);
-                }
-            }
-            DeferRun dr([&](){
-                for (auto &&st : curChecks)
-                {
-                    auto &cf = st.second;
-                    *cf = false; // clear check flag
-                }
-            });
+                if (m_stop_flag)
+                    break;
+                if (!m_runPools.count(poolIns))
+                    continue;
 
-            for (auto &&st : curChecks)
-            {
-                auto &cf = st.second;
-                auto &poolIns = st.first;
+                m_checkingPool = poolIns;
+                al.unlock();
                 poolIns->checkReleaseClient();
-                *cf = false; // clear check flag
+                al.lock();
+                m_checkingPool = nullptr;
+                m_cv.notify_all();
             }
         }
 
     private:
-        std::atomic<bool>           m_stop_flag{false};
-        std::atomic<std::size_t>    m_count{0};
-        std::thread                 m_timer_thread;
+        bool                        m_stop_flag{false};     // m_lock locked
+        std::thread                 m_timer_thread;         // m_lockThread locked
+        std::mutex                  m_lockThread;
         std::mutex                  m_lock;
-        std::map<HttpClientPool *, CheckFlagPtr>  m_runPools;
+        std::condition_variable     m_cv;
+        std::set<HttpClientPool *>  m_runPools;
+        HttpClientPool              *m_checkingPool{nullptr};
     };
     PoolGlobalTimerThread sTimerThread;
 }
@@ -148,29 +127,41 @@ namespace ppeureka { namespace curl {
 
     using DeferRun = ppeureka::helpers::DeferRun;
 
+    HttpClientPool::HttpClientPool(std::size_t defaultConnCount, std::size_t maxConnCount, const PoolConfig &poolConfig)
+        : m_defaultConnCount(defaultConnCount)
+        , m_maxConnCount((std::min)(maxConnCount, static_cast<std::size_t>(UINT32_MAX - 1)))
+        , m_minIdleCount(poolConfig.minIdleConnCount)
+        , m_warmCount(poolConfig.warmConnCount)
+        , m_warmPath(poolConfig.warmPath)
+        , m_waitTimeout(poolConfig.maxConnWaitTimeout)
+    {
+        // no slot until the first client, so a large max conn count costs nothing
+    }
+
     HttpClientPool::~HttpClientPool()
     {
         stop();
     };
 
-    void HttpClientPool::start(const std::string& endpoint, const TlsConfig& tlsConfig)
+    void HttpClientPool::start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig)
     {
         m_stopped = false;
+        m_requesting->waiting = false;
 
         setEndpoint(endpoint);
 
-        auto al = get_lock();
-        m_tls = tlsConfig;
-        m_lastCheckMaxUsingCount = 0;
+        {
+            auto al = get_lock();
+            m_tls = tlsConfig;
+            m_transport = transportConfig;
+            m_lastCheckMaxUsingCount = 0;
+            m_usageAverage = 0;
+        }
 
         // match agent, to reduce resouce when instance query in memory.
-        // default count
-        //while (m_pool.size() < m_defaultConnCount)
-        //{
-        //    HttpClientPtr cli{create_client()};
-        //    cli->start(m_endpoint, m_tls);
-        //    m_pool.emplace_back(cli);
-        //}
+        //   no client is created by default, unless warm up is set.
+        if (m_warmCount > 0)
+            warmUp(m_warmCount, m_warmPath);
 
         sTimerThread.incStart(this);
     }
@@ -180,31 +171,92 @@ namespace ppeureka { namespace curl {
         auto al = get_lock();
         m_endpoint = endpoint;
 
-        for (auto &&cli : m_pool)
-        {
-            cli->setEndpoint(endpoint);
-        }
+        forEachClient([&endpoint](HttpClient &cli){
+            cli.setEndpoint(endpoint);
+        });
     }
 
-    HttpClientPool::GetResponse HttpClientPool::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data)
+    HttpClientPool::GetResponse HttpClientPool::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts)
     {
-        ++m_requesting_count;
+        ++m_requesting->count;
         DeferRun dr1([this](){
-            --m_requesting_count;
+            endRequest();
         });
 
         if (isStopped())
             throw Error("stoped");
 
-        auto cli = getClient();
-        if (!cli)
+        auto slot = getClient(true);
+        if (!slot)
             throw NetError("no client in pool");
         
-        DeferRun dr2([this, cli](){
-            freeClient(cli);
+        DeferRun dr2([this, slot](){
+            freeClient(slot);
+        });
+
+        return slot->cli->request(method, path, query, data, opts);
+    }
+
+    void HttpClientPool::requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback)
+    {
+        ++m_requesting->count;
+
+        std::shared_ptr<HttpEngine> engine;
+        Slot *slot = nullptr;
+        try
+        {
+            if (isStopped())
+                throw Error("stoped");
+
+            engine = getEngine();
+            // not wait a free client, so it is not blocking when called in io thread, such as retry in callback.
+            slot = getClient();
+            slot->cli->prepareRequest(method, path, query, data, opts);
+        }
+        catch (...)
+        {
+            freeClient(slot);
+            endRequest();
+            if (callback)
+                callback(std::current_exception(), GetResponse{});
+            return;
+        }
+
+        std::weak_ptr<HttpEngine> weakEngine = engine;
+        slot->cli->watchCancel([weakEngine](){
+            if (auto engine = weakEngine.lock())
+                engine->abortCancelled();
         });
+        auto cli = slot->cli.get();
+        engine->add(slot->cli->handle(), [this, slot, callback](CURLcode err){
+            std::exception_ptr ep;
+            GetResponse resp;
+            try
+            {
+                resp = slot->cli->completeRequest(err);
+            }
+            catch (...)
+            {
+                ep = std::current_exception();
+            }
+            // stop may release the pool once request end, so this is not used after
+            freeClient(slot);
+            endRequest();
 
-        return cli->request(method, path, query, data);
+            if (callback)
+            {
+                try
+                {
+                    callback(ep, std::move(resp));
+                }
+                catch (...)
+                {
+                    // TODO trace it
+                }
+            }
+        }, [cli](){
+            return cli->isAborted();
+        });
     }
 
     void HttpClientPool::stop()
@@ -213,64 +265,399 @@ namespace ppeureka { namespace curl {
 
         {
             auto al = get_lock();
-            for (auto &&cli : m_pool)
-            {
-                cli->stop();
-            }
-            for (auto &&cli : m_using)
+            forEachClient([](HttpClient &cli){
+                cli.stop();
+            });
+        }
+        {
+            // waiters fail
+            auto_lock_type al{m_lockWait};
+            for (auto &&w : m_waiters)
             {
-                cli->stop();
+                w->cv.notify_one();
             }
         }
         
         sTimerThread.decStop(this);
 
-        // wait requesting 0
-        while (m_requesting_count > 0)
+        // wait requesting 0, the aborted requests done soon.
+        //   the async ones are done by io thread, so remove them from the engine if in it.
+        auto engine = getEngine(false);
+        bool inIoThread = engine && engine->isIoThread();
+        // a stalled transfer does not see stopped by the progress callback
+        if (engine && !inIoThread)
+            engine->abortCancelled();
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            auto &requesting = *m_requesting;
+            auto_lock_type al{requesting.lock};
+            requesting.waiting = true;
+            while (0 != requesting.count.load())
+            {
+                if (!inIoThread)
+                {
+                    requesting.doneWait.wait(al);
+                    continue;
+                }
+
+                al.unlock();
+                removeFromEngine(*engine);
+                al.lock();
+                // others may add one before stopped seen, and the sync ones are done by their threads
+                requesting.doneWait.wait_for(al, std::chrono::milliseconds{10});
+            }
         }
 
+        // the clients still in use are back to the free stack later, and released with the pool.
         auto al = get_lock();
-        m_pool.clear();
-        m_using.clear();
+        uint32_t index;
+        while (popSlot(m_freeHead, index))
+        {
+            slotAt(index).cli.reset();
+            --m_clientCount;
+            ++m_closeCount;
+            pushSlot(m_emptyHead, index);
+        }
     }
 
-    HttpClientPool::HttpClientPtr HttpClientPool::getClient()
+    void HttpClientPool::removeFromEngine(HttpEngine &engine)
     {
-        auto al = get_lock();
-        if (m_pool.empty())
+        std::vector<CURL *> handles;
+        {
+            auto al = get_lock();
+            forEachClient([&handles](HttpClient &cli){
+                handles.emplace_back(cli.handle());
+            });
+        }
+        // the idle ones and the sync ones are not in the engine
+        for (auto &&handle : handles)
+        {
+            engine.remove(handle);
+        }
+    }
+
+    void HttpClientPool::endRequest()
+    {
+        // waiting is set before the count checked by stop, so the last one always notifies.
+        auto requesting = m_requesting;
+        if (0 == --requesting->count && requesting->waiting.load())
+        {
+            auto_lock_type al{requesting->lock};
+            requesting->doneWait.notify_all();
+        }
+    }
+
+    HttpClientPool::Slot *HttpClientPool::getClient(bool canWait)
+    {
+        Slot *slot = nullptr;
+        uint32_t index;
+        // the sync ones not overtake the waiters, the async ones can not wait so try it anyway
+        ++m_checkoutCount;
+        if (!canWait || 0 == m_waitCount.load())
+        {
+            if (popSlot(m_freeHead, index))
+            {
+                slot = &slotAt(index);
+                ++m_hitCount;
+            }
+            else
+                slot = newClient();
+        }
+        if (!slot)
         {
-            if (m_using.size() + m_pool.size() >= m_maxConnCount)
+            if (!canWait || m_waitTimeout.count() <= 0)
                 throw Error("limit to max conn count");
 
-            HttpClientPtr cli{create_client()};
-            cli->start(m_endpoint, m_tls);
-            m_pool.emplace_back(cli);
+            auto_lock_type al{m_lockWait};
+            slot = waitClient(al);
         }
-        auto cli = m_pool.front();
-        m_pool.pop_front();
 
-        m_using.emplace_back(cli);
-        if (m_lastCheckMaxUsingCount < m_using.size())
-            m_lastCheckMaxUsingCount = m_using.size();
-        
-        return cli;
+        auto usingCount = ++m_usingCount;
+        auto maxUsingCount = m_lastCheckMaxUsingCount.load(std::memory_order_relaxed);
+        while (maxUsingCount < usingCount
+            && !m_lastCheckMaxUsingCount.compare_exchange_weak(maxUsingCount, usingCount, std::memory_order_relaxed))
+        {
+        }
+
+        return slot;
+    }
+
+    HttpClientPool::Slot *HttpClientPool::waitClient(auto_lock_type &al)
+    {
+        // blocking io thread will dead lock, the clients are freed in it.
+        auto engine = getEngine(false);
+        if (engine && engine->isIoThread())
+            throw Error("limit to max conn count");
+
+        Waiter w;
+        m_waiters.push_back(&w);
+        ++m_waitCount;
+        // a client freed before m_waitCount increased is not dispatched by freeClient.
+        //   the fence pairs with the one in freeClient, so at least one side sees the other.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        dispatchWaiters();
+
+        auto deadline = std::chrono::steady_clock::now() + m_waitTimeout;
+        while (!w.slot)
+        {
+            if (isStopped() || std::cv_status::timeout == w.cv.wait_until(al, deadline))
+            {
+                if (w.slot)
+                    break;
+
+                m_waiters.erase(std::find(m_waiters.begin(), m_waiters.end(), &w));
+                --m_waitCount;
+                if (isStopped())
+                    throw Error("stoped");
+                throw Error("limit to max conn count");
+            }
+        }
+        return w.slot;
     }
 
-    void HttpClientPool::freeClient(HttpClientPool::HttpClientPtr cli)
+    void HttpClientPool::dispatchWaiters()
     {
-        if (!cli)
+        uint32_t index;
+        while (!m_waiters.empty())
+        {
+            Slot *slot = nullptr;
+            try
+            {
+                if (popSlot(m_freeHead, index))
+                    slot = &slotAt(index);
+                else
+                    slot = newClient();
+            }
+            catch (...)
+            {
+                // TODO trace it
+            }
+            if (!slot)
+                break;
+
+            auto w = m_waiters.front();
+            m_waiters.pop_front();
+            --m_waitCount;
+            w->slot = slot;
+            w->cv.notify_one();
+        }
+    }
+
+    HttpClientPool::Slot *HttpClientPool::newClient()
+    {
+        auto al = get_lock();
+        Slot *slot = nullptr;
+        uint32_t index;
+        if (popSlot(m_emptyHead, index))
+            slot = &slotAt(index);
+        else
+            slot = addSlot();
+        if (!slot)
+            return nullptr;
+
+        try
+        {
+            std::unique_ptr<HttpClient> cli{new HttpClient()};
+            cli->setTimingSink(&m_timing);
+            cli->start(m_endpoint, m_tls, m_transport);
+            if (isStopped())
+                cli->stop();
+            slot->cli = std::move(cli);
+            ++m_clientCount;
+            ++m_createCount;
+        }
+        catch (...)
+        {
+            pushSlot(m_emptyHead, slot->index);
+            throw;
+        }
+        return slot;
+    }
+
+    HttpClientPool::Slot &HttpClientPool::slotAt(uint32_t index) const
+    {
+        // chunk k holds [SLOT_CHUNK_BASE * (2^k - 1), SLOT_CHUNK_BASE * (2^(k+1) - 1))
+        auto n = static_cast<uint64_t>(index) / SLOT_CHUNK_BASE + 1;
+        std::size_t chunk = 0;
+        while (n >>= 1)
+        {
+            ++chunk;
+        }
+        auto offset = index - SLOT_CHUNK_BASE * ((static_cast<uint64_t>(1) << chunk) - 1);
+        return m_slotChunks[chunk][static_cast<std::size_t>(offset)];
+    }
+
+    HttpClientPool::Slot *HttpClientPool::addSlot()
+    {
+        if (m_slotCount >= m_maxConnCount)
+            return nullptr;
+
+        auto index = static_cast<uint32_t>(m_slotCount);
+        auto n = static_cast<uint64_t>(index) / SLOT_CHUNK_BASE + 1;
+        if (0 == (n & (n - 1)) && 0 == index % SLOT_CHUNK_BASE)
+        {
+            // the first one of a chunk, create the chunk
+            std::size_t chunk = 0;
+            while (n >>= 1)
+            {
+                ++chunk;
+            }
+            auto size = (std::min)(static_cast<std::size_t>(SLOT_CHUNK_BASE) << chunk, m_maxConnCount - m_slotCount);
+            m_slotChunks[chunk].reset(new Slot[size]);
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                m_slotChunks[chunk][i].index = static_cast<uint32_t>(index + i);
+            }
+        }
+        ++m_slotCount;
+        return &slotAt(index);
+    }
+
+    void HttpClientPool::warmUp(std::size_t count, const std::string &path)
+    {
+        std::shared_ptr<HttpEngine> engine;
+        try
+        {
+            engine = getEngine();
+        }
+        catch (...)
+        {
+            // TODO trace it
             return;
+        }
+        if (engine->isIoThread())
+            return;
+
+        // new clients rather than getClient, so every warm request has its own connection.
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            ++m_requesting->count;
+            Slot *slot = nullptr;
+            try
+            {
+                slot = newClient();
+                if (slot)
+                {
+                    ++m_usingCount;
+                    slot->cli->prepareRequest(METHOD_HEAD, path, "", nullptr, nullptr);
+                }
+            }
+            catch (...)
+            {
+                // TODO trace it
+                freeClient(slot);
+                slot = nullptr;
+            }
+            if (!slot)
+            {
+                endRequest();
+                break;
+            }
+
+            auto cli = slot->cli.get();
+            engine->add(slot->cli->handle(), [this, slot](CURLcode err){
+                try
+                {
+                    // any status is ok, the connection is kept
+                    slot->cli->completeRequest(err);
+                }
+                catch (...)
+                {
+                    // TODO trace it
+                }
+                freeClient(slot);
+                endRequest();
+            }, [cli](){
+                return cli->isAborted();
+            });
+        }
+    }
+
+    void HttpClientPool::freeClient(HttpClientPool::Slot *slot)
+    {
+        if (!slot)
+            return;
+
+        --m_usingCount;
+        pushSlot(m_freeHead, slot->index);
 
+        // pushed before checked, so a waiter counted later finds the client itself.
+        //   the push is a release store only, the fence keeps the load after it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waitCount.load() > 0)
+        {
+            auto_lock_type al{m_lockWait};
+            dispatchWaiters();
+        }
+    }
+
+    void HttpClientPool::pushSlot(std::atomic<uint64_t> &head, uint32_t index)
+    {
+        auto &slot = slotAt(index);
+        auto oldHead = head.load(std::memory_order_relaxed);
+        uint64_t newHead;
+        do
+        {
+            slot.next.store(static_cast<uint32_t>(oldHead), std::memory_order_relaxed);
+            newHead = (((oldHead >> 32) + 1) << 32) | (index + 1);
+        } while (!head.compare_exchange_weak(oldHead, newHead, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool HttpClientPool::popSlot(std::atomic<uint64_t> &head, uint32_t &index)
+    {
+        auto oldHead = head.load(std::memory_order_acquire);
+        uint64_t newHead;
+        do
+        {
+            auto top = static_cast<uint32_t>(oldHead);
+            if (0 == top)
+                return false;
+            // next may be changed by others when the head changed, then the CAS fails and retry.
+            auto next = slotAt(top - 1).next.load(std::memory_order_relaxed);
+            newHead = (((oldHead >> 32) + 1) << 32) | next;
+        } while (!head.compare_exchange_weak(oldHead, newHead, std::memory_order_acq_rel, std::memory_order_acquire));
+
+        index = static_cast<uint32_t>(oldHead) - 1;
+        return true;
+    }
+
+    template<class F>
+    void HttpClientPool::forEachClient(F f)
+    {
+        for (std::size_t i = 0; i < m_slotCount; ++i)
+        {
+            auto &slot = slotAt(static_cast<uint32_t>(i));
+            if (slot.cli)
+                f(*slot.cli);
+        }
+    }
+
+    std::shared_ptr<HttpEngine> HttpClientPool::getEngine(bool create)
+    {
         auto al = get_lock();
-        auto it = std::find(m_using.begin(), m_using.end(), cli);
-        assert(it != m_using.end());
-        m_using.erase(it);
+        if (!m_engine && create)
+            m_engine = HttpEngine::shared();
+        return m_engine;
+    }
 
-        m_pool.emplace_front(cli);
+    bool HttpClientPool::getPoolStats(PoolStats &stats) const
+    {
+        {
+            auto al = get_lock();
+            stats.clientCount = m_clientCount;
+            stats.usageAverage = m_usageAverage;
+        }
+        stats.usingCount = m_usingCount;
+        stats.checkoutCount = m_checkoutCount;
+        stats.hitCount = m_hitCount;
+        stats.createCount = m_createCount;
+        stats.closeCount = m_closeCount;
+        return true;
     }
 
+    // keep the clients of the smoothed usage, so a spike does not close the connections reopened soon.
+    //   average = peak of window * 0.3 + prev average * 0.7
+    //   keep = max(defaultConnCount, warmConnCount, max(average, peak of window) + minIdleConnCount)
+    //   close only when clients exceed keep by half, and close half of the excess at one time.
     void HttpClientPool::checkReleaseClient()
     {
        if (isStopped())
@@ -278,19 +665,30 @@ namespace ppeureka { namespace curl {
            return;
        }
 
-       decltype(m_pool) tmpPool;
+       std::vector<std::unique_ptr<HttpClient>> tmpPool;  // released out of lock
        {
+           std::size_t lastCheckMaxUsingCount = m_lastCheckMaxUsingCount.exchange(0);
+
            auto al = get_lock();
-           std::size_t lastCheckMaxUsingCount = m_lastCheckMaxUsingCount;
-           m_lastCheckMaxUsingCount = 0;
-           auto keepCount = lastCheckMaxUsingCount + lastCheckMaxUsingCount/2 + 1;
+           m_usageAverage = lastCheckMaxUsingCount * 0.3 + m_usageAverage * 0.7;
+           auto usage = static_cast<std::size_t>(std::ceil(m_usageAverage));
+           usage = usage > lastCheckMaxUsingCount ? usage : lastCheckMaxUsingCount;
+           auto keepCount = usage + m_minIdleCount;
            keepCount = keepCount > m_defaultConnCount ? keepCount : m_defaultConnCount;
-           
-           while (m_pool.size() > keepCount)
+           // the warm ones are wanted even if idle
+           keepCount = keepCount > m_warmCount ? keepCount : m_warmCount;
+           if (m_clientCount <= keepCount + keepCount/2)
+               return;
+
+           auto closeCount = (m_clientCount - keepCount + 1) / 2;
+           uint32_t index;
+           while (closeCount > 0 && m_clientCount > m_usingCount + m_minIdleCount && popSlot(m_freeHead, index))
            {
-               auto cli = m_pool.back();
-               m_pool.pop_back();
-               tmpPool.emplace_back(cli);
+               tmpPool.emplace_back(std::move(slotAt(index).cli));
+               --m_clientCount;
+               --closeCount;
+               ++m_closeCount;
+               pushSlot(m_emptyHead, index);
            }
        }
     }
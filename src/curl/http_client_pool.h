@@ -8,38 +8,66 @@
 
 #include <ppeureka/http_client.h>
 #include "http_helpers.h"
+#include "http_client.h"
+#include "http_engine.h"
 #include <curl/curl.h>
 #include <memory>
 #include <atomic>
 #include <mutex>
 #include <thread>
-#include <list>
+#include <cstdint>
+#include <deque>
+#include <condition_variable>
 
 namespace ppeureka { namespace curl {
 
     class HttpClientPool: public ppeureka::http::impl::Client
     {
-        using HttpClientPtr = std::shared_ptr<ppeureka::http::impl::Client>;
+        // one client place in pool, the client is created and released under m_lock,
+        //   its index is in m_freeHead when the client is idle, in m_emptyHead when no client.
+        struct Slot
+        {
+            std::unique_ptr<HttpClient> cli;
+            std::atomic<uint32_t>       next{0};    // next slot index + 1 in the stack, 0 for end
+            uint32_t                    index{0};
+        };
+        // slot storage grows by chunk when the slots in use exceed, chunk k has SLOT_CHUNK_BASE << k slots.
+        //   a chunk is not moved or released until the pool released, so the slot pointer keeps valid.
+        enum { SLOT_CHUNK_BASE = 16, SLOT_CHUNK_MAX = 32 };
+
+        // a request waiting for a free client
+        struct Waiter
+        {
+            Slot                        *slot{nullptr};
+            std::condition_variable     cv;
+        };
 
     public:
         using GetResponse = std::tuple<http::Status, ResponseHeaders, std::string>;
         using TlsConfig = ppeureka::http::impl::TlsConfig;
+        using TransportConfig = ppeureka::http::impl::TransportConfig;
+        using PoolConfig = ppeureka::http::impl::PoolConfig;
         using HttpMethod = ppeureka::http::impl::HttpMethod;
+        using RequestOptions = ppeureka::http::impl::RequestOptions;
+        using PoolStats = ppeureka::http::impl::PoolStats;
+        using TimingStats = ppeureka::http::impl::TimingStats;
 
         using lock_type = std::mutex;
         using auto_lock_type = std::unique_lock<lock_type>;
 
-        HttpClientPool(std::size_t defaultConnCount, std::size_t maxConnCount)
-            : m_defaultConnCount(defaultConnCount)
-            , m_maxConnCount(maxConnCount) {
-        }
+        HttpClientPool(std::size_t defaultConnCount, std::size_t maxConnCount, const PoolConfig &poolConfig = PoolConfig{});
 
         // == Client interface ==
         virtual ~HttpClientPool() override;
         void setEndpoint(const std::string &endpoint) override;
-        void start(const std::string& endpoint, const TlsConfig& tlsConfig) override;
-        GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr) override;
+        void start(const std::string& endpoint, const TlsConfig& tlsConfig, const TransportConfig& transportConfig = TransportConfig{}) override;
+        GetResponse request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data = nullptr, const RequestOptions *opts = nullptr) override;
+        // the pooled client is transfered by the shared HttpEngine, so the caller is not blocked.
+        void requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback) override;
+        // set stop flag, and wait all request end. the async requests are aborted at once if called in io thread.
         void stop() override;
+        bool getPoolStats(PoolStats &stats) const override;
+        bool getTimingStats(TimingStats &stats) const override { m_timing.get(stats); return true; }
         // == Client interface ==
 
         bool isStopped() const { return m_stopped.load(std::memory_order_relaxed); }
@@ -54,22 +82,79 @@ namespace ppeureka { namespace curl {
     private:
         auto_lock_type get_lock() const { return auto_lock_type{m_lock}; }
 
-        HttpClientPtr getClient();
-        void freeClient(HttpClientPtr cli);
+        // decrease m_requesting_count, wake stop when the last done.
+        void endRequest();
+        // abort the async requests in the engine, io thread only.
+        void removeFromEngine(HttpEngine &engine);
+
+        // lock free, not allocate when an idle client exists.
+        //   if canWait and maxConnWaitTimeout set, wait when all clients in use, and not overtake the waiters.
+        //   else take an idle one even if others are waiting, throw if none.
+        Slot *getClient(bool canWait = false);
+        void freeClient(Slot *slot);
+        // create client in an empty slot, nullptr if limit to max conn count.
+        Slot *newClient();
+        // the index is taken from a stack or less than m_slotCount, so its chunk exists.
+        Slot &slotAt(uint32_t index) const;
+        // add a never used slot, grow the storage if need. m_lock locked.
+        Slot *addSlot();
+        // m_lockWait locked.
+        Slot *waitClient(auto_lock_type &al);
+        void dispatchWaiters();
+        // connect count new clients by async HEAD path, not blocking.
+        void warmUp(std::size_t count, const std::string &path);
+
+        // the stack head is {tag:32, slot index + 1:32}, tag avoids ABA.
+        void pushSlot(std::atomic<uint64_t> &head, uint32_t index);
+        bool popSlot(std::atomic<uint64_t> &head, uint32_t &index);
+        // clients of all slots, m_lock locked.
+        template<class F>
+        void forEachClient(F f);
+        // created when first async request
+        std::shared_ptr<HttpEngine> getEngine(bool create = true);
 
         std::atomic_bool m_stopped{false};
         std::size_t      m_defaultConnCount{1};
         std::size_t      m_maxConnCount{1000};
 
-        std::size_t      m_lastCheckMaxUsingCount{0};
+        std::atomic<std::size_t>    m_lastCheckMaxUsingCount{0};
+        double                      m_usageAverage{0};      // m_lock locked
+        std::size_t                 m_minIdleCount{1};
+        std::size_t                 m_warmCount{0};         // kept at least
+        std::string                 m_warmPath;
 
         mutable lock_type        m_lock;
         std::string      m_endpoint;
         TlsConfig        m_tls;
-
-        std::atomic<std::size_t>    m_requesting_count{0};
-        std::list<HttpClientPtr>    m_pool;
-        std::list<HttpClientPtr>    m_using;
+        TransportConfig  m_transport;
+        std::shared_ptr<HttpEngine> m_engine;
+
+        // stop waits count 0. shared by endRequest, as the pool may be destroyed once count 0.
+        struct RequestingCount
+        {
+            std::atomic<std::size_t>    count{0};
+            std::atomic<bool>           waiting{false};
+            lock_type                   lock;
+            std::condition_variable     doneWait;
+        };
+        std::shared_ptr<RequestingCount> m_requesting{std::make_shared<RequestingCount>()};
+        std::atomic<std::size_t>    m_usingCount{0};
+        std::size_t                 m_clientCount{0};   // m_lock locked
+
+        std::atomic<uint64_t>       m_checkoutCount{0};
+        std::atomic<uint64_t>       m_hitCount{0};
+        std::atomic<uint64_t>       m_createCount{0};
+        std::atomic<uint64_t>       m_closeCount{0};
+        detail::TimingAccumulator   m_timing;           // of all clients
+        std::unique_ptr<Slot[]>     m_slotChunks[SLOT_CHUNK_MAX];   // created when need, m_lock locked
+        std::size_t                 m_slotCount{0};     // slots ever used, m_lock locked
+        std::atomic<uint64_t>       m_freeHead{0};      // stack of idle clients
+        std::atomic<uint64_t>       m_emptyHead{0};     // stack of slots without client
+
+        std::chrono::milliseconds   m_waitTimeout{0};
+        std::atomic<std::size_t>    m_waitCount{0};
+        lock_type                   m_lockWait;
+        std::deque<Waiter *>        m_waiters;
     };
 
 }}
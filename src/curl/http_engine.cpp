@@ -0,0 +1,451 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include "http_engine.h"
+#include "http_client.h"
+#include "ppeureka/error.h"
+#include <cassert>
+#include <algorithm>
+#include <vector>
+
+#ifdef PPEUREKA_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#else
+// curl_multi_poll and curl_multi_wakeup was added in libcurl 7.68.0
+#if (LIBCURL_VERSION_NUM < 0x074400)
+#error "HttpEngine requires libcurl 7.68.0 or newer"
+#endif
+#endif
+
+namespace ppeureka { namespace curl {
+
+    namespace {
+        enum {
+            MAX_EVENTS = 64,
+            POLL_TIMEOUT_MS = 1000,
+        };
+    }
+
+    std::shared_ptr<HttpEngine> HttpEngine::shared()
+    {
+        static std::mutex s_lock;
+        static std::weak_ptr<HttpEngine> s_engine;
+
+        std::lock_guard<std::mutex> al{s_lock};
+        auto engine = s_engine.lock();
+        if (!engine)
+        {
+            engine.reset(new HttpEngine(), &HttpEngine::release);
+            s_engine = engine;
+        }
+        return engine;
+    }
+
+    HttpEngine::HttpEngine()
+    {
+        if (!detail::curlInitialized())
+            throw ppeureka::Error("CURL was not successfully initialized");
+
+        m_multi.reset(curl_multi_init());
+        if (!m_multi)
+            throw ppeureka::Error("CURL multi handle creation failed");
+
+        // http/2 transfers to the same host share one connection
+        curl_multi_setopt(multi(), CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+#ifdef PPEUREKA_USE_EPOLL
+        m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_epollFd < 0 || m_wakeFd < 0)
+        {
+            if (m_epollFd >= 0)
+                close(m_epollFd);
+            if (m_wakeFd >= 0)
+                close(m_wakeFd);
+            throw ppeureka::Error("epoll creation failed");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = m_wakeFd;
+        epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev);
+
+        curl_multi_setopt(multi(), CURLMOPT_SOCKETFUNCTION, &HttpEngine::socketCallback);
+        curl_multi_setopt(multi(), CURLMOPT_SOCKETDATA, this);
+        curl_multi_setopt(multi(), CURLMOPT_TIMERFUNCTION, &HttpEngine::timerCallback);
+        curl_multi_setopt(multi(), CURLMOPT_TIMERDATA, this);
+#endif
+
+        m_thread = std::thread([this](){
+            run();
+            if (m_deleteOnExit)
+                delete this;
+        });
+        m_threadId = m_thread.get_id();
+    }
+
+    HttpEngine::~HttpEngine()
+    {
+        m_stop_flag = true;
+        wakeup();
+        if (m_thread.joinable())
+            m_thread.join();
+
+#ifdef PPEUREKA_USE_EPOLL
+        close(m_wakeFd);
+        close(m_epollFd);
+#endif
+    }
+
+    void HttpEngine::release(HttpEngine *engine)
+    {
+        if (!engine->isIoThread())
+        {
+            delete engine;
+            return;
+        }
+
+        // join self is dead lock, the io thread exits after the current callback and deletes it
+        engine->m_deleteOnExit = true;
+        engine->m_stop_flag = true;
+        engine->m_thread.detach();
+    }
+
+    void HttpEngine::add(CURL *easy, DoneFunction done, AbortFunction abort)
+    {
+        if (m_stop_flag)
+        {
+            if (done)
+                done(CURLE_ABORTED_BY_CALLBACK);
+            return;
+        }
+        {
+            auto_lock_type al{m_lock};
+            // cancelled before added may be missed by the last check
+            if (abort && abort())
+                m_checkAbort = true;
+            m_pending.emplace_back(easy, Transfer{std::move(done), std::move(abort)});
+        }
+        ++m_runningCount;
+        wakeup();
+    }
+
+    void HttpEngine::addTimer(std::chrono::milliseconds delay, TaskFunction task)
+    {
+        {
+            auto_lock_type al{m_lock};
+            if (!m_timersClosed)
+            {
+                m_timers.emplace(std::chrono::steady_clock::now() + delay, std::move(task));
+                task = nullptr;
+            }
+        }
+        if (task)
+        {
+            // stopped
+            task();
+            return;
+        }
+        // the wait timeout is recomputed
+        wakeup();
+    }
+
+    bool HttpEngine::remove(CURL *easy)
+    {
+        assert(isIoThread());
+
+        DoneFunction done;
+        auto it = m_transfers.find(easy);
+        if (it != m_transfers.end())
+        {
+            curl_multi_remove_handle(multi(), easy);
+            done = std::move(it->second.done);
+            m_transfers.erase(it);
+        }
+        else
+        {
+            auto_lock_type al{m_lock};
+            auto itPending = std::find_if(m_pending.begin(), m_pending.end(), [easy](const std::pair<CURL *, Transfer> &st){
+                return st.first == easy;
+            });
+            if (itPending == m_pending.end())
+                return false;
+            done = std::move(itPending->second.done);
+            m_pending.erase(itPending);
+        }
+
+        --m_runningCount;
+        if (done)
+            done(CURLE_ABORTED_BY_CALLBACK);
+        return true;
+    }
+
+    void HttpEngine::abortCancelled()
+    {
+        m_checkAbort = true;
+        wakeup();
+    }
+
+    void HttpEngine::wakeup()
+    {
+#ifdef PPEUREKA_USE_EPOLL
+        uint64_t v = 1;
+        auto n = write(m_wakeFd, &v, sizeof(v));
+        (void)n;
+#else
+        curl_multi_wakeup(multi());
+#endif
+    }
+
+    int HttpEngine::socketCallback(CURL *, curl_socket_t s, int what, void *enginePtr, void *socketPtr)
+    {
+#ifdef PPEUREKA_USE_EPOLL
+        auto engine = static_cast<HttpEngine *>(enginePtr);
+        if (CURL_POLL_REMOVE == what)
+        {
+            epoll_ctl(engine->m_epollFd, EPOLL_CTL_DEL, s, nullptr);
+            return 0;
+        }
+
+        epoll_event ev{};
+        ev.data.fd = s;
+        if (what & CURL_POLL_IN)
+            ev.events |= EPOLLIN;
+        if (what & CURL_POLL_OUT)
+            ev.events |= EPOLLOUT;
+
+        if (socketPtr)
+        {
+            epoll_ctl(engine->m_epollFd, EPOLL_CTL_MOD, s, &ev);
+        }
+        else
+        {
+            // mark the socket has been added
+            epoll_ctl(engine->m_epollFd, EPOLL_CTL_ADD, s, &ev);
+            curl_multi_assign(engine->multi(), s, engine);
+        }
+#else
+        (void)s; (void)what; (void)enginePtr; (void)socketPtr;
+#endif
+        return 0;
+    }
+
+    int HttpEngine::timerCallback(CURLM *, long timeoutMs, void *enginePtr)
+    {
+        auto engine = static_cast<HttpEngine *>(enginePtr);
+        if (timeoutMs < 0)
+        {
+            engine->m_hasTimeout = false;
+        }
+        else
+        {
+            engine->m_hasTimeout = true;
+            engine->m_timeoutTime = std::chrono::steady_clock::now() + std::chrono::milliseconds{timeoutMs};
+        }
+        return 0;
+    }
+
+    int HttpEngine::waitTimeoutMs()
+    {
+        bool hasTimeout = m_hasTimeout;
+        auto timeoutTime = m_timeoutTime;
+        {
+            auto_lock_type al{m_lock};
+            if (!m_timers.empty() && (!hasTimeout || m_timers.begin()->first < timeoutTime))
+            {
+                hasTimeout = true;
+                timeoutTime = m_timers.begin()->first;
+            }
+        }
+        if (!hasTimeout)
+            return -1;
+        auto dur = timeoutTime - std::chrono::steady_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+        if (ms <= 0)
+            return 0;
+        // round up, avoid wake before timeout
+        return static_cast<int>(ms) + 1;
+    }
+
+    void HttpEngine::run()
+    {
+        int running = 0;
+#ifdef PPEUREKA_USE_EPOLL
+        epoll_event events[MAX_EVENTS];
+        while (!m_stop_flag)
+        {
+            int n = epoll_wait(m_epollFd, events, MAX_EVENTS, waitTimeoutMs());
+            if (n < 0 && errno != EINTR)
+                break;
+
+            for (int i = 0; i < n; ++i)
+            {
+                auto &ev = events[i];
+                if (ev.data.fd == m_wakeFd)
+                {
+                    uint64_t v = 0;
+                    auto r = read(m_wakeFd, &v, sizeof(v));
+                    (void)r;
+                    addPending();
+                    continue;
+                }
+
+                int flags = 0;
+                if (ev.events & EPOLLIN)
+                    flags |= CURL_CSELECT_IN;
+                if (ev.events & EPOLLOUT)
+                    flags |= CURL_CSELECT_OUT;
+                if (ev.events & (EPOLLERR | EPOLLHUP))
+                    flags |= CURL_CSELECT_ERR;
+                curl_multi_socket_action(multi(), ev.data.fd, flags, &running);
+            }
+
+            if (m_hasTimeout && std::chrono::steady_clock::now() >= m_timeoutTime)
+            {
+                m_hasTimeout = false;
+                curl_multi_socket_action(multi(), CURL_SOCKET_TIMEOUT, 0, &running);
+            }
+
+            checkDone();
+            checkAborted();
+            runTimers();
+        }
+#else
+        while (!m_stop_flag)
+        {
+            auto timeoutMs = waitTimeoutMs();
+            if (timeoutMs < 0 || timeoutMs > POLL_TIMEOUT_MS)
+                timeoutMs = POLL_TIMEOUT_MS;
+            curl_multi_poll(multi(), nullptr, 0, timeoutMs, nullptr);
+            if (m_stop_flag)
+                break;
+
+            addPending();
+            curl_multi_perform(multi(), &running);
+            checkDone();
+            checkAborted();
+            runTimers();
+        }
+#endif
+        // the timers may add transfers, which are aborted then
+        runTimers(true);
+        abortAll();
+    }
+
+    void HttpEngine::addPending()
+    {
+        decltype(m_pending) pending;
+        {
+            auto_lock_type al{m_lock};
+            pending.swap(m_pending);
+        }
+
+        for (auto &&st : pending)
+        {
+            auto code = curl_multi_add_handle(multi(), st.first);
+            if (CURLM_OK != code)
+            {
+                --m_runningCount;
+                if (st.second.done)
+                    st.second.done(CURLE_FAILED_INIT);
+                continue;
+            }
+            m_transfers.emplace(st.first, std::move(st.second));
+        }
+    }
+
+    void HttpEngine::checkDone()
+    {
+        int msgsInQueue = 0;
+        while (CURLMsg *msg = curl_multi_info_read(multi(), &msgsInQueue))
+        {
+            if (CURLMSG_DONE != msg->msg)
+                continue;
+
+            auto easy = msg->easy_handle;
+            auto err = msg->data.result;
+            curl_multi_remove_handle(multi(), easy);
+
+            auto it = m_transfers.find(easy);
+            if (it == m_transfers.end())
+                continue;
+            auto done = std::move(it->second.done);
+            m_transfers.erase(it);
+            --m_runningCount;
+
+            if (done)
+                done(err);
+        }
+    }
+
+    void HttpEngine::checkAborted()
+    {
+        if (!m_checkAbort.exchange(false))
+            return;
+
+        // the pending ones may be cancelled already
+        addPending();
+
+        std::vector<CURL *> aborted;
+        for (auto &&st : m_transfers)
+        {
+            if (st.second.abort && st.second.abort())
+                aborted.push_back(st.first);
+        }
+        for (auto easy : aborted)
+        {
+            remove(easy);
+        }
+    }
+
+    void HttpEngine::runTimers(bool force)
+    {
+        std::deque<TaskFunction> expired;
+        {
+            auto_lock_type al{m_lock};
+            auto end = force ? m_timers.end() : m_timers.upper_bound(std::chrono::steady_clock::now());
+            for (auto it = m_timers.begin(); it != end; ++it)
+            {
+                expired.emplace_back(std::move(it->second));
+            }
+            m_timers.erase(m_timers.begin(), end);
+            if (force)
+                m_timersClosed = true;
+        }
+
+        for (auto &&task : expired)
+        {
+            try
+            {
+                if (task)
+                    task();
+            }
+            catch (...)
+            {
+                // TODO trace it
+            }
+        }
+    }
+
+    void HttpEngine::abortAll()
+    {
+        // pending ones are added first, then abort together
+        addPending();
+
+        auto transfers = std::move(m_transfers);
+        m_transfers.clear();
+        for (auto &&st : transfers)
+        {
+            curl_multi_remove_handle(multi(), st.first);
+            --m_runningCount;
+            if (st.second.done)
+                st.second.done(CURLE_ABORTED_BY_CALLBACK);
+        }
+    }
+
+}}
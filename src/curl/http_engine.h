@@ -0,0 +1,134 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "ppeureka/config.h"
+#include <curl/curl.h>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <functional>
+
+#if defined(__linux__)
+#define PPEUREKA_USE_EPOLL
+#endif
+
+namespace ppeureka { namespace curl {
+
+    namespace detail
+    {
+        struct CurlMultiDeleter
+        {
+            void operator() (CURLM *handle) const PPEUREKA_NOEXCEPT
+            {
+                curl_multi_cleanup(handle);
+            }
+        };
+    }
+
+    // one curl multi handle driven by one io thread, many transfers run in parallel in it.
+    //   on linux, sockets are waited by epoll, others by curl_multi_poll.
+    class HttpEngine
+    {
+    public:
+        // called in io thread when transfer done.
+        using DoneFunction = std::function<void(CURLcode err)>;
+        // called in io thread when timer expired.
+        using TaskFunction = std::function<void()>;
+        // called in io thread by abortCancelled(), returns true if the transfer should be aborted.
+        using AbortFunction = std::function<bool()>;
+
+        using lock_type = std::mutex;
+        using auto_lock_type = std::unique_lock<lock_type>;
+
+        // the engine shared in process, created when first get, and stopped when no one hold it.
+        //   if the last one is released in io thread, e.g. by a done callback, the io thread exits and deletes it.
+        static std::shared_ptr<HttpEngine> shared();
+
+        // Exception:
+        //    ppeureka::Error when curl multi or io thread init fail.
+        HttpEngine();
+        ~HttpEngine();
+
+        // add the easy handle to transfer. thread safe.
+        //   the handle must not be used by others until done called.
+        //   if engine stopped before transfer done, done is called with CURLE_ABORTED_BY_CALLBACK.
+        //   abort is checked by abortCancelled() while the transfer is running.
+        void add(CURL *easy, DoneFunction done, AbortFunction abort = nullptr);
+        // run task in io thread after delay, it must not block. thread safe.
+        //   if engine stopped before expired, task is called at once when stop.
+        void addTimer(std::chrono::milliseconds delay, TaskFunction task);
+        // abort the transfer of the easy handle, done is called with CURLE_ABORTED_BY_CALLBACK before return.
+        //   io thread only, it is used to drain the transfers which can not be waited in io thread.
+        // Returns:
+        //   false if the handle is not added or done already.
+        bool remove(CURL *easy);
+        // wake the io thread to remove the transfers whose abort function returns true,
+        //   their done is called with CURLE_ABORTED_BY_CALLBACK. thread safe.
+        //   used when cancelled or stopped, a stalled transfer may not call the progress callback for long.
+        void abortCancelled();
+
+        bool isIoThread() const { return std::this_thread::get_id() == m_threadId; }
+        std::size_t runningCount() const { return m_runningCount.load(std::memory_order_relaxed); }
+
+        HttpEngine(const HttpEngine&) = delete;
+        HttpEngine& operator= (const HttpEngine&) = delete;
+
+    private:
+        static int socketCallback(CURL *easy, curl_socket_t s, int what, void *enginePtr, void *socketPtr);
+        static int timerCallback(CURLM *multi, long timeoutMs, void *enginePtr);
+
+        CURLM *multi() const PPEUREKA_NOEXCEPT { return m_multi.get(); }
+
+        // deleter of the shared one
+        static void release(HttpEngine *engine);
+
+        void run();
+        void wakeup();
+        // io thread only
+        void addPending();
+        void checkDone();
+        void checkAborted();
+        void abortAll();
+        // run the expired timers, all if force
+        void runTimers(bool force = false);
+        int waitTimeoutMs();
+
+        std::unique_ptr<CURLM, detail::CurlMultiDeleter> m_multi;
+        std::thread                 m_thread;
+        std::thread::id             m_threadId;     // kept when m_thread detached
+        bool                        m_deleteOnExit{false};  // io thread only
+        std::atomic<bool>           m_stop_flag{false};
+        std::atomic<std::size_t>    m_runningCount{0};
+        std::atomic<bool>           m_checkAbort{false};
+
+        struct Transfer
+        {
+            DoneFunction done;
+            AbortFunction abort;
+        };
+
+        lock_type                                   m_lock;
+        std::deque<std::pair<CURL *, Transfer>>     m_pending;
+        std::multimap<std::chrono::steady_clock::time_point, TaskFunction> m_timers;
+        bool                                        m_timersClosed{false};
+
+        // io thread only
+        std::map<CURL *, Transfer>                  m_transfers;
+        bool                                        m_hasTimeout{false};
+        std::chrono::steady_clock::time_point       m_timeoutTime;
+#ifdef PPEUREKA_USE_EPOLL
+        int                         m_epollFd{-1};
+        int                         m_wakeFd{-1};
+#endif
+    };
+
+}}
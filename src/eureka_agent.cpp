@@ -16,10 +16,6 @@ namespace {
     using namespace ppeureka;
     using namespace ppeureka::agent;
 
-    enum {
-        DO_THREAD_COUNT = 4,
-    };
-
     enum {
         REG_HEART_PERIOD_SECONDS = 3,
         CHECK_APP_PERIOD_SECONDS = 3,
@@ -90,12 +86,13 @@ namespace ppeureka { namespace agent {
 
     EurekaAgent::EurekaAgent(EurekaConnect &conn)
      :m_conn(conn)
-     {}
+     {
+         setInsRequestOptions(RequestOptions{});
+     }
 
      void EurekaAgent::start()
      {
          m_stop_flag = false;
-         m_do_thread.start(DO_THREAD_COUNT);
          m_timer_thread.start(1);
          m_timer_thread.emplace_back([this](){
              doTimer();
@@ -106,7 +103,19 @@ namespace ppeureka { namespace agent {
      {
          m_stop_flag = true;
          m_timer_thread.stop(true);
-         m_do_thread.stop(true);
+
+         // the cancelled hedge requests done soon
+         {
+             auto_lock_type al{m_lockHedge};
+             m_hedgeDoneWait.wait(al, [this](){
+                 return 0 == m_hedgeLegCount;
+             });
+         }
+
+         auto_lock_type al{m_lockAsync};
+         m_asyncDoneWait.wait(al, [this](){
+             return 0 == m_asyncCount;
+         });
      }
 
     // return "app:ipAddr:port"
@@ -141,9 +150,7 @@ namespace ppeureka { namespace agent {
         auto &innerReg = it->second;
         innerReg->regIns.ins = ins;
         innerReg->doing = true;
-        m_do_thread.emplace_back([this, innerReg](){
-            doRegHeart(*innerReg);
-        });
+        doRegHeart(innerReg);
     }
     void EurekaAgent::registerIns(const std::string &app, const std::string &ipAddr, int port)
     {
@@ -268,6 +275,13 @@ namespace ppeureka { namespace agent {
     }
 
 
+    void EurekaAgent::setInsRequestOptions(const RequestOptions &opts)
+    {
+        m_insReqOpts = opts;
+        m_insReqOptsNoHeader = opts;
+        m_insReqOptsNoHeader.headerCapture = RequestOptions::HEADERS_NONE;
+    }
+
     void EurekaAgent::setChooseHttpClient(const std::string &appId, ChooseHttpClientFunction f)
     {
         InnerCheckAppDataPtr innerApp;
@@ -320,6 +334,54 @@ namespace ppeureka { namespace agent {
     }
 
 
+    EurekaAgent::InsHttpClientPtr EurekaAgent::chooseOtherHttpClient(const InsHttpClient &httpCli)
+    {
+        InnerCheckAppDataPtr innerApp;
+        {
+            auto_lock_type al{m_lockApp};
+            auto it = m_apps.find(httpCli.checkIns->appId);
+            if (it == m_apps.end())
+                throw Error{"not exist instance"};
+            innerApp = it->second;
+        }
+
+        // the skipped ones lock app when destroyed, so released after unlock
+        std::vector<InsHttpClientPtr> skipped;
+        auto_lock_type al{innerApp->lock};
+        auto &app = innerApp->app;
+        auto insCount = app.insIds.size();
+        if (app.chooseFunc)
+        {
+            // the custom choice is kept, ask it again if it gives the same instance
+            for (std::size_t i=0; i < insCount; ++i)
+            {
+                auto other = app.chooseFunc(app, &innerApp->lock);
+                if (other && other->checkIns != httpCli.checkIns)
+                    return other;
+                skipped.emplace_back(std::move(other));
+            }
+            throw Error{"none instance match"};
+        }
+
+        // start from the next of httpCli, so the hedges are spread
+        auto itFirst = std::find(app.insIds.begin(), app.insIds.end(), httpCli.ins->instanceId);
+        std::size_t firstIndex = itFirst == app.insIds.end() ? 0 : (itFirst - app.insIds.begin()) + 1;
+        for (std::size_t i=0; i < insCount; ++i)
+        {
+            const auto &insId = app.insIds[(firstIndex + i) % insCount];
+            auto itIns = app.inses.find(insId);
+            if (itIns == app.inses.end() || itIns->second == httpCli.checkIns)
+                continue;
+            auto &chkIns = itIns->second;
+            if (!chkIns->errState.tryChoose())
+                continue;
+            return std::make_shared<InsHttpClient>(chkIns, this, &innerApp->lock);
+        }
+
+        throw Error{"none instance match"};
+    }
+
+
     // the snapshot of agent
     void EurekaAgent::getSnap(AgentSnap &snap)
     {
@@ -349,9 +411,22 @@ namespace ppeureka { namespace agent {
                     snapIns.endpoint = getEndpoint(srcIns.ins);
                     snapIns.statis = srcIns.statis;
                     snapIns.errState = srcIns.errState;
+                    srcIns.cli->getTimingStats(snapIns.timing);
                 }
             }
         }
+
+        m_conn.getEndpointTimingStats(snap.eurekaEndpoints);
+        if (m_registry)
+            snap.registry = m_registry->stats();
+    }
+
+    void EurekaAgent::setRegistryCache(bool enable)
+    {
+        if (enable)
+            m_registry.reset(new RegistryCache(m_conn));
+        else
+            m_registry.reset();
     }
 
     void EurekaAgent::onInsHttpClientConstruct(const EurekaAgent::InsHttpClient &httpCli)
@@ -376,6 +451,208 @@ namespace ppeureka { namespace agent {
             chkIns->errState.sucRequest();
     }
 
+    struct EurekaAgent::HedgeState
+    {
+        lock_type                   lock;
+        std::condition_variable     doneWait;
+        std::size_t                 pendingCount{0};
+        bool                        hasResult{false};
+        std::string                 body;
+        std::exception_ptr          resultErr;  // the answer is not 2xx
+        std::exception_ptr          firstErr;   // net error or 5xx
+        std::vector<CancelTokenPtr> cancels;
+
+        bool isDone() const { return hasResult || 0 == pendingCount; }
+    };
+
+    EurekaAgent::Duration EurekaAgent::hedgeDelay(const InsHttpClient &httpCli)
+    {
+        CheckInsStatistics::SumAvg sum;
+        {
+            auto_lock_type al{*httpCli.appLock};
+            for (auto &&sa : httpCli.checkIns->statis.respSucTimeMicroSec)
+            {
+                sum.all += sa.all;
+                sum.count += sa.count;
+            }
+        }
+        if (sum.count <= 0)
+            return m_hedge.maxDelay;
+
+        auto delay = std::chrono::microseconds{static_cast<int64_t>(sum.avg() * m_hedge.latencyFactor)};
+        if (delay < m_hedge.minDelay)
+            return m_hedge.minDelay;
+        if (delay > m_hedge.maxDelay)
+            return m_hedge.maxDelay;
+        return delay;
+    }
+
+    void EurekaAgent::startHedgeLeg(const HedgeStatePtr &state, const InsHttpClient &httpCli, const std::string& path, const std::string& query, const RequestOptions &opts)
+    {
+        // opts must valid until request done, so keep a copy in the callback
+        auto legOpts = std::make_shared<RequestOptions>(opts);
+        legOpts->headerCapture = RequestOptions::HEADERS_NONE;
+        legOpts->cancelToken = std::make_shared<CancelToken>(opts.cancelToken);
+        {
+            auto_lock_type al{state->lock};
+            ++state->pendingCount;
+            state->cancels.emplace_back(legOpts->cancelToken);
+        }
+        {
+            auto_lock_type al{m_lockHedge};
+            ++m_hedgeLegCount;
+        }
+
+        // the instance may be deleted by refresh before done, keep its client
+        auto checkIns = httpCli.checkIns;
+        auto appId = checkIns->appId;
+        auto insId = httpCli.ins->instanceId;
+        auto tpPrev = std::chrono::steady_clock::now();
+        checkIns->cli->requestAsync(HttpMethod::METHOD_GET, path, query, nullptr, legOpts.get(),
+            [this, state, legOpts, checkIns, appId, insId, tpPrev](std::exception_ptr err, GetResponse resp){
+                auto tpNow = std::chrono::steady_clock::now();
+                auto respMicroSec = std::chrono::duration_cast<std::chrono::microseconds>(tpNow - tpPrev).count();
+
+                bool aborted = false;
+                if (!err && std::get<0>(resp).code()/100 == 5)
+                {
+                    // 5xx httpcode
+                    err = std::make_exception_ptr(BadStatus(http::Status(std::get<0>(resp).code()), "5xx httpcode"));
+                }
+                else if (err)
+                {
+                    try
+                    {
+                        std::rethrow_exception(err);
+                    }
+                    catch (OperationAborted &)
+                    {
+                        aborted = true;
+                    }
+                    catch (...)
+                    {
+                    }
+                }
+                // the loser cancelled by hedge is not the instance error
+                if (!aborted)
+                    onInsRequestDone(appId, insId, !err, respMicroSec);
+
+                {
+                    auto_lock_type al{state->lock};
+                    --state->pendingCount;
+                    if (err)
+                    {
+                        if (!state->firstErr)
+                            state->firstErr = err;
+                    }
+                    else if (!state->hasResult)
+                    {
+                        state->hasResult = true;
+                        auto &&status = std::get<0>(resp);
+                        if (status.code()/100 != 2)
+                            state->resultErr = std::make_exception_ptr(BadStatus(http::Status(status.code()), "not 2xx httpcode"));
+                        else
+                            state->body = std::move(std::get<2>(resp));
+                    }
+                    if (state->isDone())
+                        state->doneWait.notify_all();
+                }
+
+                auto_lock_type al{m_lockHedge};
+                if (--m_hedgeLegCount == 0)
+                    m_hedgeDoneWait.notify_all();
+            });
+    }
+
+    void EurekaAgent::onInsRequestDone(const std::string &appId, const std::string &insId, bool suc, int64_t respMicroSec)
+    {
+        InnerCheckAppDataPtr innerApp;
+        {
+            auto_lock_type al{m_lockApp};
+            auto it = m_apps.find(appId);
+            if (it == m_apps.end())
+                return;
+            innerApp = it->second;
+        }
+
+        auto_lock_type al{innerApp->lock};
+        auto it = innerApp->app.inses.find(insId);
+        if (it == innerApp->app.inses.end())
+            return; // deleted
+        auto &chkIns = it->second;
+        chkIns->statis.add(suc, respMicroSec);
+
+        if (!suc)
+            chkIns->errState.occurErr();
+        else
+            chkIns->errState.sucRequest();
+    }
+
+    void EurekaAgent::insRequestAsync(const InsHttpClient &httpCli, HttpMethod method, const std::string& path, const std::string& query, const std::string *data,
+        const std::shared_ptr<RequestOptions> &opts, bool is5xxErr, ResponseCallback callback)
+    {
+        {
+            auto_lock_type al{m_lockAsync};
+            ++m_asyncCount;
+        }
+
+        // the instance may be deleted by refresh before done, keep its client
+        auto checkIns = httpCli.checkIns;
+        auto appId = checkIns->appId;
+        auto insId = httpCli.ins->instanceId;
+        auto tpPrev = std::chrono::steady_clock::now();
+        checkIns->cli->requestAsync(method, path, query, data, opts.get(),
+            [this, opts, checkIns, appId, insId, tpPrev, is5xxErr, callback](std::exception_ptr err, GetResponse resp){
+                auto tpNow = std::chrono::steady_clock::now();
+                auto respMicroSec = std::chrono::duration_cast<std::chrono::microseconds>(tpNow - tpPrev).count();
+
+                bool counted = true;
+                if (!err && is5xxErr && std::get<0>(resp).code()/100 == 5)
+                {
+                    // 5xx httpcode
+                    err = std::make_exception_ptr(BadStatus(http::Status(std::get<0>(resp).code()), "5xx httpcode"));
+                }
+                else if (err)
+                {
+                    try
+                    {
+                        std::rethrow_exception(err);
+                    }
+                    catch (OperationAborted &)
+                    {
+                        // given up by caller, not the instance error
+                        counted = false;
+                    }
+                    catch (Error &)
+                    {
+                        // TODO trace it
+                    }
+                    catch (...)
+                    {
+                        counted = false;
+                    }
+                }
+                if (counted)
+                    onInsRequestDone(appId, insId, !err, respMicroSec);
+
+                if (callback)
+                {
+                    try
+                    {
+                        callback(err, std::move(resp));
+                    }
+                    catch (...)
+                    {
+                        // TODO trace it
+                    }
+                }
+
+                auto_lock_type al{m_lockAsync};
+                if (--m_asyncCount == 0)
+                    m_asyncDoneWait.notify_all();
+            });
+    }
+
     void EurekaAgent::doTimer()
     {
         auto tpPrevHeart = std::chrono::steady_clock::now();
@@ -418,15 +695,26 @@ namespace ppeureka { namespace agent {
             if (PeriodSeconds(tpNow, innerReg->regIns.lastHeartTime) >= period)
             {
                 innerReg->doing = true;
-                m_do_thread.emplace_back([this, innerReg](){
-                    doRegHeart(*innerReg);
-                });
+                doRegHeart(innerReg);
             }
         }
     }
 
     void EurekaAgent::doTimerCheckApp()
     {
+        // one delta for all apps
+        if (m_registry)
+        {
+            try
+            {
+                m_registry->refresh();
+            }
+            catch (Error &)
+            {
+                // TODO trace it
+            }
+        }
+
         // refresh apps
         std::list<std::string> needCheckApps;
         {
@@ -474,24 +762,31 @@ namespace ppeureka { namespace agent {
         }
     }
 
-    void EurekaAgent::doRegHeart(EurekaAgent::InnerRegInsData &innerReg)
+    void EurekaAgent::doRegHeart(const EurekaAgent::InnerRegInsDataPtr &innerReg)
     {
-        DeferRun dr1([&](){
-            innerReg.doing = false;
-        });
-
-        try 
         {
-            auto &ins = innerReg.regIns;
-            ins.lastHeartTime = std::chrono::steady_clock::now();
-            m_conn.sendHeart(ins.ins->app, ins.ins->instanceId);
-            ins.heartSucCount += 1;
-        }
-        catch(Error &)
-        {
-            // TODO trace it
-            innerReg.regIns.heartErrCount += 1;
+            auto_lock_type al{m_lockAsync};
+            ++m_asyncCount;
         }
+
+        auto &ins = innerReg->regIns;
+        ins.lastHeartTime = std::chrono::steady_clock::now();
+        m_conn.sendHeartAsync(ins.ins->app, ins.ins->instanceId, [this, innerReg](std::exception_ptr err){
+            if (err)
+            {
+                // TODO trace it
+                innerReg->regIns.heartErrCount += 1;
+            }
+            else
+            {
+                innerReg->regIns.heartSucCount += 1;
+            }
+            innerReg->doing = false;
+
+            auto_lock_type al{m_lockAsync};
+            if (--m_asyncCount == 0)
+                m_asyncDoneWait.notify_all();
+        });
     }
 
     EurekaAgent::InsHttpClientPtr EurekaAgent::chooseHttpClient(EurekaAgent::CheckAppData &app, lock_type *appLock)
@@ -522,13 +817,22 @@ namespace ppeureka { namespace agent {
         });
 
         InstanceInfoPtrDeque insesInQuery;
-        try
+        if (m_registry)
         {
-            insesInQuery = m_conn.queryInsByAppId(appId);
+            // bootstrap at the first use, then refreshed by timer
+            m_registry->bootstrap();
+            insesInQuery = m_registry->queryInsByAppId(appId);
         }
-        catch (NotFoundError &e)
+        else
         {
-            // not found same as empty instances
+            try
+            {
+                insesInQuery = m_conn.queryInsByAppId(appId);
+            }
+            catch (NotFoundError &e)
+            {
+                // not found same as empty instances
+            }
         }
 
         {
@@ -569,10 +873,12 @@ namespace ppeureka { namespace agent {
                     // not exists in check, add
                     hasAdd = true;
                     auto chkIns = std::make_shared<CheckInsData>();
+                    chkIns->appId = appId;
                     chkIns->ins = insQ;
-                    chkIns->cli.reset(ppeureka::http::impl::create_client_pool());
+                    chkIns->cli.reset(ppeureka::http::impl::create_client_pool(3, 1000, m_insPool));
                     ppeureka::http::impl::TlsConfig defaultTls;
-                    chkIns->cli->start(getEndpoint(insQ), defaultTls);
+                    // warm connections are opened in background, not blocking refresh
+                    chkIns->cli->start(getEndpoint(insQ), defaultTls, m_insTransport);
 
                     innerApp->app.inses.emplace(insQ->instanceId, chkIns);
                 }
@@ -723,35 +1029,51 @@ namespace ppeureka { namespace agent {
         if (eAgent)
             eAgent->onInsHttpClientDestroy(*this);
     }
-    GetResponse EurekaAgent::InsHttpClient::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data)
+    GetResponse EurekaAgent::InsHttpClient::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts)
     {
         auto tpPrev = std::chrono::steady_clock::now();
         try 
         {
-            auto resp = checkIns->cli->request(method, path, query, data);
+            auto resp = checkIns->cli->request(method, path, query, data, opts ? opts : &eAgent->m_insReqOpts);
 
             auto tpNow = std::chrono::steady_clock::now();
             auto respMicroSec = std::chrono::duration_cast<std::chrono::microseconds>(tpNow - tpPrev).count();
             eAgent->onInsHttpClientRequestDone(*this, true, respMicroSec);
             return resp;
         }
-        catch(Error &e)
+        catch(OperationAborted &)
+        {
+            // given up by caller, not the instance error
+            throw;
+        }
+        catch(Error &)
         {
             // TODO trace it
             auto tpNow = std::chrono::steady_clock::now();
             auto respMicroSec = std::chrono::duration_cast<std::chrono::microseconds>(tpNow - tpPrev).count();
             eAgent->onInsHttpClientRequestDone(*this, false, respMicroSec);
 
-            throw e;
+            throw;
         }
     }
-    std::string EurekaAgent::InsHttpClient::requestRespData(HttpMethod method, const std::string& path, const std::string& query, const std::string *data)
+    std::string EurekaAgent::InsHttpClient::requestRespData(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts)
     {
+        // a streamed body cannot be taken from two instances
+        const bool hasConsumer = opts ? static_cast<bool>(opts->bodyConsumer) : static_cast<bool>(eAgent->m_insReqOpts.bodyConsumer);
+        if (HttpMethod::METHOD_GET == method && eAgent->m_hedge.enable && !hasConsumer)
+            return requestHedged(path, query, opts ? *opts : eAgent->m_insReqOpts);
+
         auto tpPrev = std::chrono::steady_clock::now();
         bool hasDone = false;
         try 
         {
-            auto resp = checkIns->cli->request(method, path, query, data);
+            RequestOptions noHeaderOpts;
+            if (opts)
+            {
+                noHeaderOpts = *opts;
+                noHeaderOpts.headerCapture = RequestOptions::HEADERS_NONE;
+            }
+            auto resp = checkIns->cli->request(method, path, query, data, opts ? &noHeaderOpts : &eAgent->m_insReqOptsNoHeader);
             
             // status error
             auto &&status = std::get<0>(resp);
@@ -772,7 +1094,12 @@ namespace ppeureka { namespace agent {
             }
             return std::move(std::get<2>(resp));
         }
-        catch(Error &e)
+        catch(OperationAborted &)
+        {
+            // given up by caller, not the instance error
+            throw;
+        }
+        catch(Error &)
         {
             // TODO trace it
             if (!hasDone)
@@ -783,7 +1110,76 @@ namespace ppeureka { namespace agent {
                 hasDone = true;
             }
 
-            throw e;
+            throw;
+        }
+    }
+    void EurekaAgent::InsHttpClient::requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, ResponseCallback callback)
+    {
+        // opts must valid until request done, so keep a copy in the callback
+        auto asyncOpts = std::make_shared<RequestOptions>(opts ? *opts : eAgent->m_insReqOpts);
+        eAgent->insRequestAsync(*this, method, path, query, data, asyncOpts, false, std::move(callback));
+    }
+    void EurekaAgent::InsHttpClient::requestRespDataAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, const RequestOptions *opts, RespDataCallback callback)
+    {
+        auto asyncOpts = std::make_shared<RequestOptions>(opts ? *opts : eAgent->m_insReqOptsNoHeader);
+        asyncOpts->headerCapture = RequestOptions::HEADERS_NONE;
+        eAgent->insRequestAsync(*this, method, path, query, data, asyncOpts, true, [callback](std::exception_ptr err, GetResponse resp){
+            auto &&status = std::get<0>(resp);
+            if (!err && status.code()/100 != 2)
+            {
+                // not 2xx httpcode
+                err = std::make_exception_ptr(BadStatus(http::Status(status.code()), "not 2xx httpcode"));
+            }
+            if (callback)
+                callback(err, err ? std::string() : std::move(std::get<2>(resp)));
+        });
+    }
+    std::string EurekaAgent::InsHttpClient::requestHedged(const std::string& path, const std::string& query, const RequestOptions &opts)
+    {
+        auto state = std::make_shared<HedgeState>();
+        DeferRun dr([&](){
+            // cancel the loser, it is not waited
+            auto_lock_type al{state->lock};
+            for (auto &&cancel : state->cancels)
+            {
+                cancel->cancel();
+            }
+        });
+
+        eAgent->startHedgeLeg(state, *this, path, query, opts);
+
+        auto delay = eAgent->hedgeDelay(*this);
+        bool done{false};
+        {
+            auto_lock_type al{state->lock};
+            done = state->doneWait.wait_for(al, delay, [&](){
+                return state->isDone();
+            });
+        }
+        if (!done)
+        {
+            // no response in delay, send to another instance
+            try
+            {
+                auto other = eAgent->chooseOtherHttpClient(*this);
+                eAgent->startHedgeLeg(state, *other, path, query, opts);
+            }
+            catch (Error &)
+            {
+                // no other instance, wait the first
+            }
+        }
+
+        auto_lock_type al{state->lock};
+        state->doneWait.wait(al, [&](){
+            return state->isDone();
+        });
+        if (state->hasResult)
+        {
+            if (state->resultErr)
+                std::rethrow_exception(state->resultErr);
+            return std::move(state->body);
         }
+        std::rethrow_exception(state->firstErr);
     }
-}}
\ No newline at end of file
+}}
@@ -8,14 +8,67 @@
 #include "ppeureka/eureka_connect.h"
 #include "s11n_types.h"
 #include "all_clients.h"
+#include "curl/http_engine.h"
 #include "ppeureka/helpers.h"
 #include <time.h>
 #include <thread>
+#include <algorithm>
+#include <random>
+#include <cctype>
 
 namespace {
     using namespace ppeureka;
     using namespace ppeureka::agent;
 
+    enum {
+        MAX_REDIRECT_PEERS = 8,     // peers out of endpoints followed until start again
+    };
+
+    template<class T>
+    inline std::shared_ptr<T> copyPtr(const std::shared_ptr<T> &p)
+    {
+        return p ? std::make_shared<T>(*p) : nullptr;
+    }
+
+    // "scheme://host[:port]" of url, empty if not an absolute url.
+    inline std::string urlOrigin(const std::string &url)
+    {
+        auto posScheme = url.find("://");
+        if (std::string::npos == posScheme || 0 == posScheme)
+            return std::string();
+        auto posPath = url.find_first_of("/?#", posScheme + 3);
+        if (posPath == posScheme + 3)
+            return std::string();
+        return url.substr(0, posPath);
+    }
+
+    // origin in lower case and with the default port, so the same peer is matched exactly.
+    inline std::string originKey(const std::string &origin)
+    {
+        std::string key = origin;
+        std::transform(key.begin(), key.end(), key.begin(), [](char c){
+            return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        });
+        auto posHost = key.find("://");
+        if (std::string::npos == posHost)
+            return key;
+        posHost += 3;
+        auto posColon = key.rfind(':');
+        auto posBracket = key.rfind(']');   // ipv6
+        if (posColon < posHost || (std::string::npos != posBracket && posColon < posBracket))
+            key += 0 == key.compare(0, 8, "https://") ? ":443" : ":80";
+        return key;
+    }
+
+    // the response is not used by the no query requests
+    inline http::impl::Client::ResponseCallback toResponseCallback(DoneCallback callback)
+    {
+        return [callback](std::exception_ptr err, GetResponse){
+            if (callback)
+                callback(err);
+        };
+    }
+
     inline InstanceInfoPtrDeque toAppsInstances(const GetResponse &resp)
     {
         // {"applications": {
@@ -41,6 +94,17 @@ namespace {
         return ret;
     }
 
+    inline ApplicationsPtr toApplications(const GetResponse &resp)
+    {
+        // {"applications": {"versions__delta": "", "apps__hashcode": "", "application": [
+        auto &&json_str = std::get<2>(resp);
+        auto json_obj = s11n::detail::parse_json(json_str);
+
+        auto apps = std::make_shared<Applications>();
+        s11n::load(json_obj, *apps, "applications");
+        return apps;
+    }
+
     inline InstanceInfoPtrDeque toAppInstances(const GetResponse &resp)
     {
         // {"application": {"instance": [
@@ -80,30 +144,132 @@ namespace ppeureka { namespace agent {
     using s11n::load;
     using namespace http::impl;
 
+    EurekaConnect::EurekaConnect()
+    {
+        // full registry is big and compress well
+        m_transport.acceptEncoding = "gzip";
+
+        RequestOptions opts;
+        opts.connectTimeout = std::chrono::seconds{5};
+        opts.lowSpeedLimit = 1;
+        opts.lowSpeedTime = std::chrono::seconds{30};
+        setRequestOptions(opts);
+    }
+
+    void EurekaConnect::setTransport(const TransportConfig &transport)
+    {
+        auto acceptEncoding = std::move(m_transport.acceptEncoding);
+        m_transport = transport;
+        if (m_transport.acceptEncoding.empty())
+            m_transport.acceptEncoding = std::move(acceptEncoding);
+    }
+
+    void EurekaConnect::setRequestOptions(const RequestOptions &opts)
+    {
+        m_reqOpts = opts;
+        // only the redirect header is used by retry
+        m_reqOpts.headerCapture = RequestOptions::HEADERS_NAMED;
+        m_reqOpts.headerNames = {"Location"};
+        // the registry body is parsed and built by connect
+        m_reqOpts.bodyConsumer = nullptr;
+        m_reqOpts.bodyBuffers.clear();
+    }
+
     void EurekaConnect::start()
     {
-        m_client.reset(create_client_pool(m_defaultConnCount, m_maxConnCount));
-        m_client->start(currentEndPoint(), m_tls);
+        // one client per endpoint, so the connections are kept when switch endpoint
+        std::vector<std::unique_ptr<http::impl::Client>> clients;
+        auto count = m_endpoints.empty() ? 1 : m_endpoints.size();
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            clients.emplace_back(createClient(m_endpoints.empty() ? "" : m_endpoints[i]));
+        }
+        m_clients = std::move(clients);
+
+        auto_lock_type al{m_lockRedirect};
+        m_redirectClient = nullptr;
+        m_redirectClients.clear();
+    }
+
+    std::unique_ptr<http::impl::Client> EurekaConnect::createClient(const std::string &endpoint)
+    {
+        std::unique_ptr<http::impl::Client> cli;
+        if (HTTP_VERSION_2 == m_transport.httpVersion || HTTP_VERSION_2_PRIOR_KNOWLEDGE == m_transport.httpVersion)
+            cli.reset(create_client_async(m_maxConnCount));
+        else
+            cli.reset(create_client_pool(m_defaultConnCount, m_maxConnCount, m_pool));
+        cli->start(endpoint, m_tls, m_transport);
+        return cli;
     }
 
     void EurekaConnect::stop()
     {
-        if (!m_client)
-            return;
-        m_client->stop();
+        for (auto &&cli : m_clients)
+        {
+            cli->stop();
+        }
+        {
+            auto_lock_type al{m_lockRedirect};
+            for (auto &&st : m_redirectClients)
+            {
+                st.second->stop();
+            }
+        }
+
+        // the retries of async requests fail at once after clients stopped, wait the backoff ones.
+        auto_lock_type al{m_lockAsync};
+        m_asyncDoneWait.wait(al, [this](){
+            return 0 == m_asyncCount;
+        });
     }
 
     void EurekaConnect::switchEndpoint(std::size_t endpointIndex)
     {
+        // back from the redirected peer
+        m_redirectClient = nullptr;
         if (m_endpoints.empty())
         {
             m_endpointsIndex = 0;
             return;
         }
         m_endpointsIndex = endpointIndex % m_endpoints.size();
+    }
+
+    void EurekaConnect::getEndpointTimingStats(std::map<std::string, TimingStats> &stats) const
+    {
+        for (std::size_t i = 0; i < m_clients.size(); ++i)
+        {
+            auto endpoint = i < m_endpoints.size() ? m_endpoints[i] : std::string();
+            m_clients[i]->getTimingStats(stats[endpoint]);
+        }
 
-        if (m_client)
-            m_client->setEndpoint(currentEndPoint());
+        auto_lock_type al{m_lockRedirect};
+        for (auto &&st : m_redirectClients)
+        {
+            st.second->getTimingStats(stats[st.first]);
+        }
+    }
+
+    http::impl::Client &EurekaConnect::currentClient()
+    {
+        if (auto cli = m_redirectClient.load())
+            return *cli;
+        return *m_clients[m_endpointsIndex % m_clients.size()];
+    }
+
+    bool EurekaConnect::redirectTo(const std::string &origin)
+    {
+        auto_lock_type al{m_lockRedirect};
+        auto it = m_redirectClients.find(origin);
+        if (it == m_redirectClients.end())
+        {
+            // the clients may be in use by others, so never evicted, but limited
+            if (m_redirectClients.size() >= MAX_REDIRECT_PEERS)
+                return false;
+            it = m_redirectClients.emplace(origin, createClient(origin)).first;
+        }
+        m_redirectClient = it->second.get();
+        return true;
     }
 
     std::string EurekaConnect::currentEndPoint() const
@@ -161,8 +327,7 @@ namespace ppeureka { namespace agent {
         // {"applications": {"application": ["instance": [
         checkClientValid();
 
-        auto resp = request(METHOD_GET, "/eureka/apps", "");
-        return toAppsInstances(resp);
+        return querySingleFlight("/eureka/apps", toAppsInstances);
     }
 
     InstanceInfoPtrDeque EurekaConnect::queryInsByAppId(const std::string &appId)
@@ -170,8 +335,7 @@ namespace ppeureka { namespace agent {
         // {"application": {"instance": [
         checkClientValid();
 
-        auto resp = request(METHOD_GET, "/eureka/apps/" + helpers::encodeUrl(appId), "");
-        return toAppInstances(resp);
+        return querySingleFlight("/eureka/apps/" + helpers::encodeUrl(appId), toAppInstances);
     }
 
     InstanceInfoPtrDeque EurekaConnect::queryInsByAppIdInsId(const std::string &appId, const std::string &insId)
@@ -180,8 +344,7 @@ namespace ppeureka { namespace agent {
         // or 404
         checkClientValid();
 
-        auto resp = request(METHOD_GET, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId), "");
-        return toInstances(resp);
+        return querySingleFlight("/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId), toInstances);
     }
 
     InstanceInfoPtrDeque EurekaConnect::queryInsByVip(const std::string &vip)
@@ -189,8 +352,7 @@ namespace ppeureka { namespace agent {
         // {"applications": {"application": ["instance": [
         checkClientValid();
 
-        auto resp = request(METHOD_GET, "/eureka/vips/" + helpers::encodeUrl(vip), "");
-        return toAppsInstances(resp);
+        return querySingleFlight("/eureka/vips/" + helpers::encodeUrl(vip), toAppsInstances);
     }
 
     InstanceInfoPtrDeque EurekaConnect::queryInsBySVip(const std::string &svip)
@@ -198,8 +360,179 @@ namespace ppeureka { namespace agent {
         // {"applications": {"application": ["instance": [
         checkClientValid();
 
-        auto resp = request(METHOD_GET, "/eureka/svips/" + helpers::encodeUrl(svip), "");
-        return toAppsInstances(resp);
+        return querySingleFlight("/eureka/svips/" + helpers::encodeUrl(svip), toAppsInstances);
+    }
+
+    ApplicationsPtr EurekaConnect::queryApps()
+    {
+        checkClientValid();
+
+        return toApplications(request(METHOD_GET, "/eureka/apps", ""));
+    }
+
+    ApplicationsPtr EurekaConnect::queryAppsDelta()
+    {
+        checkClientValid();
+
+        return toApplications(request(METHOD_GET, "/eureka/apps/delta", ""));
+    }
+
+    InstanceInfoPtrDeque EurekaConnect::copyInstances(const InstanceInfoPtrDeque &inses)
+    {
+        InstanceInfoPtrDeque ret;
+        for (auto &&ins : inses)
+        {
+            auto copy = copyPtr(ins);
+            if (copy)
+            {
+                // the members shared by pointer are copied too
+                copy->port = copyPtr(ins->port);
+                copy->securePort = copyPtr(ins->securePort);
+                copy->dataCenterInfo = copyPtr(ins->dataCenterInfo);
+                copy->leaseInfo = copyPtr(ins->leaseInfo);
+                copy->metadata = copyPtr(ins->metadata);
+            }
+            ret.emplace_back(std::move(copy));
+        }
+        return ret;
+    }
+
+    InstanceInfoPtrDeque EurekaConnect::querySingleFlight(const std::string &path, ParseFunction parse)
+    {
+        QueryFuture fut;
+        auto prom = joinFlight(path, fut, nullptr);
+        if (!prom)
+            return copyInstances(fut.get());
+
+        InstanceInfoPtrDeque ret;
+        try
+        {
+            auto resp = request(METHOD_GET, path, "");
+            endFlight(path, prom, nullptr, parse(resp), &ret);
+        }
+        catch (...)
+        {
+            endFlight(path, prom, std::current_exception(), InstanceInfoPtrDeque{}, nullptr);
+            throw;
+        }
+        return ret;
+    }
+
+    void EurekaConnect::querySingleFlightAsync(const std::string &path, ParseFunction parse, QueryCallback callback)
+    {
+        if (m_clients.empty())
+        {
+            if (callback)
+                callback(std::make_exception_ptr(Error("need start suc.")), InstanceInfoPtrDeque{});
+            return;
+        }
+
+        QueryFuture fut;
+        auto prom = joinFlight(path, fut, std::move(callback));
+        if (!prom)
+            return;
+
+        requestAsync(METHOD_GET, path, "", nullptr, [this, path, parse, prom](std::exception_ptr err, GetResponse resp){
+            InstanceInfoPtrDeque ret;
+            if (!err)
+            {
+                try
+                {
+                    ret = parse(resp);
+                }
+                catch (...)
+                {
+                    err = std::current_exception();
+                }
+            }
+            endFlight(path, prom, err, std::move(ret), nullptr);
+        });
+    }
+
+    EurekaConnect::QueryPromisePtr EurekaConnect::joinFlight(const std::string &path, QueryFuture &fut, QueryCallback callback)
+    {
+        QueryPromisePtr prom;
+        auto_lock_type al{m_lockFlight};
+        auto it = m_flights.find(path);
+        if (it == m_flights.end())
+        {
+            prom = std::make_shared<std::promise<InstanceInfoPtrDeque>>();
+            it = m_flights.emplace(path, Flight{}).first;
+            it->second.fut = prom->get_future().share();
+        }
+        fut = it->second.fut;
+        if (callback)
+            it->second.callbacks.emplace_back(std::move(callback));
+        else if (!prom)
+            ++it->second.waitCount;
+        return prom;
+    }
+
+    void EurekaConnect::endFlight(const std::string &path, const QueryPromisePtr &prom, std::exception_ptr err, InstanceInfoPtrDeque inses, InstanceInfoPtrDeque *ret)
+    {
+        // removed before result set, so the later callers request newer data.
+        std::vector<QueryCallback> callbacks;
+        bool waited = false;
+        {
+            auto_lock_type al{m_lockFlight};
+            auto it = m_flights.find(path);
+            if (it != m_flights.end())
+            {
+                callbacks.swap(it->second.callbacks);
+                waited = it->second.waitCount > 0;
+                m_flights.erase(it);
+            }
+        }
+
+        // the result in the future is read only, the waiters copy it.
+        //   the last one of the leader and the callbacks takes it if no waiter, others get a copy.
+        if (err)
+            prom->set_exception(err);
+        else
+            prom->set_value(inses);
+
+        if (ret)
+            *ret = (waited || !callbacks.empty()) ? copyInstances(inses) : inses;
+
+        for (std::size_t i = 0; i < callbacks.size(); ++i)
+        {
+            try
+            {
+                if (waited || i + 1 < callbacks.size())
+                    callbacks[i](err, copyInstances(inses));
+                else
+                    callbacks[i](err, inses);
+            }
+            catch (...)
+            {
+                // TODO trace it
+            }
+        }
+    }
+
+    void EurekaConnect::queryInsAllAsync(QueryCallback callback)
+    {
+        querySingleFlightAsync("/eureka/apps", toAppsInstances, std::move(callback));
+    }
+
+    void EurekaConnect::queryInsByAppIdAsync(const std::string &appId, QueryCallback callback)
+    {
+        querySingleFlightAsync("/eureka/apps/" + helpers::encodeUrl(appId), toAppInstances, std::move(callback));
+    }
+
+    void EurekaConnect::queryInsByAppIdInsIdAsync(const std::string &appId, const std::string &insId, QueryCallback callback)
+    {
+        querySingleFlightAsync("/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId), toInstances, std::move(callback));
+    }
+
+    void EurekaConnect::queryInsByVipAsync(const std::string &vip, QueryCallback callback)
+    {
+        querySingleFlightAsync("/eureka/vips/" + helpers::encodeUrl(vip), toAppsInstances, std::move(callback));
+    }
+
+    void EurekaConnect::queryInsBySVipAsync(const std::string &svip, QueryCallback callback)
+    {
+        querySingleFlightAsync("/eureka/svips/" + helpers::encodeUrl(svip), toAppsInstances, std::move(callback));
     }
 
     void EurekaConnect::registerIns(const InstanceInfoPtr &ins)
@@ -241,9 +574,52 @@ namespace ppeureka { namespace agent {
         request(METHOD_PUT, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId) + "/metadata", helpers::encodeUrl(key) + "=" + helpers::encodeUrl(value));
     }
 
+    void EurekaConnect::registerInsAsync(const InstanceInfoPtr &ins, DoneCallback callback)
+    {
+        if (!ins)
+        {
+            if (callback)
+                callback(std::make_exception_ptr(ParamError("instance nullptr")));
+            return;
+        }
+        // {"instance": {
+        s11n::Json::object jobj;
+        s11n::Json::object jinso;
+        to_json(jinso, *ins);
+        jobj["instance"] = std::move(jinso);
+        auto s = s11n::Json(std::move(jobj)).dump();
+
+        requestAsync(METHOD_POST, "/eureka/apps/" + helpers::encodeUrl(ins->app), "", &s, toResponseCallback(std::move(callback)));
+    }
+
+    void EurekaConnect::unregisterInsAsync(const std::string &appId, const std::string &insId, DoneCallback callback)
+    {
+        requestAsync(METHOD_DELETE, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId), "", nullptr, toResponseCallback(std::move(callback)));
+    }
+
+    void EurekaConnect::sendHeartAsync(const std::string &appId, const std::string &insId, DoneCallback callback)
+    {
+        requestAsync(METHOD_PUT, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId), "", nullptr, toResponseCallback(std::move(callback)));
+    }
+
+    void EurekaConnect::statusOutOfServiceAsync(const std::string &appId, const std::string &insId, DoneCallback callback)
+    {
+        requestAsync(METHOD_PUT, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId) + "/status", "value=OUT_OF_SERVICE", nullptr, toResponseCallback(std::move(callback)));
+    }
+
+    void EurekaConnect::statusUpAsync(const std::string &appId, const std::string &insId, DoneCallback callback)
+    {
+        requestAsync(METHOD_DELETE, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId) + "/status", "value=UP", nullptr, toResponseCallback(std::move(callback)));
+    }
+
+    void EurekaConnect::updateMetadataAsync(const std::string &appId, const std::string &insId, const std::string &key, const std::string &value, DoneCallback callback)
+    {
+        requestAsync(METHOD_PUT, "/eureka/apps/" + helpers::encodeUrl(appId) + "/" + helpers::encodeUrl(insId) + "/metadata", helpers::encodeUrl(key) + "=" + helpers::encodeUrl(value), nullptr, toResponseCallback(std::move(callback)));
+    }
+
     void EurekaConnect::checkClientValid()
     {
-        if (!m_client)
+        if (m_clients.empty())
             throw Error("need start suc.");
     }
 
@@ -259,67 +635,164 @@ namespace ppeureka { namespace agent {
         return false;
     }
 
-    bool EurekaConnect::doRetry(std::size_t tryCount, const GetResponse *resp)
+    bool EurekaConnect::doRetry(std::size_t tryCount, const GetResponse *resp, std::chrono::milliseconds &delay)
     {
+        delay = std::chrono::milliseconds{0};
         if (m_retryFunc)
             return m_retryFunc(tryCount, resp);
-        return defaultRetry(tryCount, resp);
+        return checkRetry(tryCount, resp, delay);
+    }
+
+    RetryBudget &RetryBudget::shared()
+    {
+        static RetryBudget s_budget;
+        return s_budget;
+    }
+
+    void RetryBudget::configure(double ratio, double maxTokens)
+    {
+        std::lock_guard<std::mutex> al{m_lock};
+        m_ratio = ratio;
+        m_maxTokens = maxTokens;
+        m_tokens = (std::min)(m_tokens, m_maxTokens);
+    }
+
+    void RetryBudget::deposit()
+    {
+        std::lock_guard<std::mutex> al{m_lock};
+        m_tokens = (std::min)(m_tokens + m_ratio, m_maxTokens);
+    }
+
+    bool RetryBudget::withdraw()
+    {
+        std::lock_guard<std::mutex> al{m_lock};
+        if (m_tokens < 1)
+        {
+            ++m_denied;
+            return false;
+        }
+        m_tokens -= 1;
+        ++m_retried;
+        return true;
+    }
+
+    RetryBudget::Stats RetryBudget::stats() const
+    {
+        std::lock_guard<std::mutex> al{m_lock};
+        Stats st;
+        st.retried = m_retried;
+        st.denied = m_denied;
+        st.tokens = m_tokens;
+        return st;
+    }
+
+    std::chrono::milliseconds EurekaConnect::retryBackoff(std::size_t tryCount)
+    {
+        // full jitter, so the callers do not retry at the same time
+        auto n = (std::min)(tryCount - 1, std::size_t{16});
+        auto maxMs = (std::min)(m_retryPolicy.baseDelay.count() << n, m_retryPolicy.maxDelay.count());
+        if (maxMs <= 0)
+            return std::chrono::milliseconds{0};
+
+        static thread_local std::minstd_rand s_rnd{std::random_device{}()};
+        std::uniform_int_distribution<int64_t> dist{0, static_cast<int64_t>(maxMs)};
+        return std::chrono::milliseconds{dist(s_rnd)};
     }
 
     bool EurekaConnect::defaultRetry(std::size_t tryCount, const GetResponse *resp)
+    {
+        std::chrono::milliseconds delay{0};
+        if (!checkRetry(tryCount, resp, delay))
+            return false;
+        if (delay.count() > 0)
+            std::this_thread::sleep_for(delay);
+        return true;
+    }
+
+    bool EurekaConnect::checkRetry(std::size_t tryCount, const GetResponse *resp, std::chrono::milliseconds &delay)
     {
         if (tryCount > 2*m_endpoints.size())
             return false;
+
+        // follow a redirect is not a retry of failure, so not limited by the budget
+        if (resp && http::HC_TemporaryRedirect == std::get<0>(*resp).code())
+            return followRedirect(*resp);
+
+        if (m_retryPolicy.budget && !m_retryPolicy.budget->withdraw())
+        {
+            // no retry now, but the later requests go to the next endpoint
+            if (!resp)
+                switchEndpoint(m_endpointsIndex + 1);
+            return false;
+        }
+
         if (resp)
         {
             // httpcode valid
             auto &&status = std::get<0>(*resp);
-            auto hc = status.code();
-            if (http::HC_InternalServerError == hc)
+            // an overloaded server is not hit again at once, 502, 503 and 504 as well as 500
+            if (5 == status.code()/100)
             {
-                std::this_thread::sleep_for(std::chrono::milliseconds{200});
-            }
-            else if (http::HC_TemporaryRedirect == hc)
-            {
-                // Location
-                auto &&headers = std::get<1>(*resp);
-                auto it = headers.find("Location");
-                if (it == headers.end())
-                    it = headers.find("location");
-                if (it != headers.end() && !it->second.empty())
-                {
-                    m_client->setEndpoint(it->second);
-                }
-                else
-                {
-                    // fail, no retry
-                    return false;
-                }
+                delay = retryBackoff(tryCount);
             }
             return true;
         }
-        // net error, swith next
+        // net error, swith next. the endpoints may fail together, so sleep even the next not tried.
         std::size_t n = m_endpointsIndex;
         switchEndpoint(++n);
+        delay = retryBackoff(tryCount);
         return true;
     }
 
+    bool EurekaConnect::followRedirect(const GetResponse &resp)
+    {
+        // Location
+        auto &&headers = std::get<1>(resp);
+        auto it = headers.find("Location");
+        if (it == headers.end())
+            it = headers.find("location");
+        auto origin = it != headers.end() ? urlOrigin(it->second) : std::string();
+        if (origin.empty())
+        {
+            // fail, no retry
+            return false;
+        }
+
+        // the request path is sent again, so only the peer of Location is used.
+        //   switch to the pool of the peer if known, else a pool of the peer until the next switch.
+        auto key = originKey(origin);
+        auto itEp = std::find_if(m_endpoints.begin(), m_endpoints.end(), [&key](const std::string &ep){
+            return key == originKey(urlOrigin(ep));
+        });
+        if (itEp != m_endpoints.end())
+        {
+            switchEndpoint(static_cast<std::size_t>(itEp - m_endpoints.begin()));
+            return true;
+        }
+        return redirectTo(origin);
+    }
+
     GetResponse EurekaConnect::request(HttpMethod method, const std::string& path, const std::string& query, const std::string *data)
     {
         std::size_t tryCount = 0;
+        std::chrono::milliseconds delay{0};
         while (true)
         {
+            if (delay.count() > 0)
+                std::this_thread::sleep_for(delay);
             ++tryCount;
             try
             {
-                auto resp = m_client->request(method, path, query, data);
+                auto resp = currentClient().request(method, path, query, data, &m_reqOpts);
                 bool needRetry = false;
                 if (checkHttpCodeSuc(resp, needRetry))
                 {
                     // suc
+                    if (m_retryPolicy.budget)
+                        m_retryPolicy.budget->deposit();
                     return resp;
                 }
-                if (needRetry && doRetry(tryCount, &resp))
+                if (needRetry && doRetry(tryCount, &resp, delay))
                 {
                     continue;
                 }
@@ -332,16 +805,135 @@ namespace ppeureka { namespace agent {
                 std::string msg = status.message() + "(" + std::to_string(status.code()) + ")";
                 throw BadStatus(status, std::move(msg));
             }
-            catch (const NetError &e)
+            catch (const NetError &)
             {
                 // NetError try next ?
-                if (!doRetry(tryCount, nullptr))
+                if (!doRetry(tryCount, nullptr, delay))
+                {
+                    // break, rethrow as is, so TimeoutError is kept
+                    throw;
+                }
+            }
+        }
+    }
+
+    void EurekaConnect::requestAsync(HttpMethod method, const std::string& path, const std::string& query, const std::string *data, ResponseCallback callback)
+    {
+        auto req = std::make_shared<AsyncRequest>();
+        req->method = method;
+        req->path = path;
+        req->query = query;
+        if (data)
+        {
+            req->data = *data;
+            req->hasData = true;
+        }
+        req->callback = std::move(callback);
+
+        if (m_clients.empty())
+        {
+            if (req->callback)
+                req->callback(std::make_exception_ptr(Error("need start suc.")), GetResponse{});
+            return;
+        }
+
+        {
+            auto_lock_type al{m_lockAsync};
+            if (!m_engine)
+                m_engine = curl::HttpEngine::shared();
+            ++m_asyncCount;
+        }
+        sendAsync(req);
+    }
+
+    void EurekaConnect::sendAsync(const AsyncRequestPtr &req)
+    {
+        ++req->tryCount;
+        currentClient().requestAsync(req->method, req->path, req->query, req->hasData ? &req->data : nullptr, &m_reqOpts,
+            [this, req](std::exception_ptr err, GetResponse resp){
+                onAsyncResponse(req, err, std::move(resp));
+            });
+    }
+
+    void EurekaConnect::onAsyncResponse(const AsyncRequestPtr &req, std::exception_ptr err, GetResponse resp)
+    {
+        std::chrono::milliseconds delay{0};
+        bool retry = false;
+        try
+        {
+            if (err)
+                std::rethrow_exception(err);
+
+            bool needRetry = false;
+            if (checkHttpCodeSuc(resp, needRetry))
+            {
+                // suc
+                if (m_retryPolicy.budget)
+                    m_retryPolicy.budget->deposit();
+                endAsync(req, nullptr, std::move(resp));
+                return;
+            }
+            if (needRetry && doRetry(req->tryCount, &resp, delay))
+            {
+                retry = true;
+            }
+            else
+            {
+                // status error
+                auto &&status = std::get<0>(resp);
+                if (status.code() == 404)
                 {
-                    // break
-                    throw e;
+                    throw NotFoundError{};
                 }
+                std::string msg = status.message() + "(" + std::to_string(status.code()) + ")";
+                throw BadStatus(status, std::move(msg));
             }
         }
+        catch (const NetError &)
+        {
+            // NetError try next ?
+            err = std::current_exception();
+            retry = doRetry(req->tryCount, nullptr, delay);
+        }
+        catch (...)
+        {
+            err = std::current_exception();
+        }
+
+        if (!retry)
+        {
+            endAsync(req, err, GetResponse{});
+            return;
+        }
+
+        if (delay.count() <= 0)
+        {
+            sendAsync(req);
+            return;
+        }
+        // backoff not blocking io thread, if engine stopped the retry fails at once
+        m_engine->addTimer(delay, [this, req](){
+            sendAsync(req);
+        });
+    }
+
+    void EurekaConnect::endAsync(const AsyncRequestPtr &req, std::exception_ptr err, GetResponse resp)
+    {
+        if (req->callback)
+        {
+            try
+            {
+                req->callback(err, std::move(resp));
+            }
+            catch (...)
+            {
+                // TODO trace it
+            }
+        }
+
+        auto_lock_type al{m_lockAsync};
+        if (0 == --m_asyncCount)
+            m_asyncDoneWait.notify_all();
     }
 }}
 
@@ -353,8 +945,13 @@ namespace ppeureka { namespace http { namespace impl {
         return new ppeureka::curl::HttpClient();
     }
 
-    Client *create_client_pool(std::size_t defaultConnCount, std::size_t maxConnCount)
+    Client *create_client_pool(std::size_t defaultConnCount, std::size_t maxConnCount, const PoolConfig &poolConfig)
+    {
+        return new ppeureka::curl::HttpClientPool(defaultConnCount, maxConnCount, poolConfig);
+    }
+
+    Client *create_client_async(std::size_t maxConnCount)
     {
-        return new ppeureka::curl::HttpClientPool(defaultConnCount, maxConnCount);
+        return new ppeureka::curl::AsyncHttpClient(maxConnCount);
     }
 }}}
\ No newline at end of file
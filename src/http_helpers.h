@@ -8,6 +8,8 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
+#include <string>
 
 
 namespace ppeureka { namespace http { namespace impl {
@@ -22,9 +24,87 @@ namespace ppeureka { namespace http { namespace impl {
         return 0 == strcmp(v, "true");
     }
 
-    inline std::string makeUrl(const std::string& addr, const std::string& path, const std::string& query)
+    namespace detail {
+        inline bool isHeaderSpace(char c)
+        {
+            return ' ' == c || '\t' == c;
+        }
+
+        inline bool isDigit(char c)
+        {
+            return c >= '0' && c <= '9';
+        }
+
+        // remove tail "\r\n" and spaces
+        inline size_t trimLineEnd(const char *buf, size_t size)
+        {
+            while (size > 0 && ('\n' == buf[size - 1] || '\r' == buf[size - 1] || isHeaderSpace(buf[size - 1])))
+                --size;
+            return size;
+        }
+    }
+
+    // Parse status line like "HTTP/1.1 200 OK\r\n" or "HTTP/2 200\r\n", no allocation.
+    //   reason points into buf, may be empty.
+    // Returns:
+    //   false if not a status line.
+    inline bool parseStatusLine(const char *buf, size_t size, int &code, const char *&reason, size_t &reasonLen)
     {
-        std::string res;
+        size = detail::trimLineEnd(buf, size);
+        if (size < 5 || 0 != memcmp(buf, "HTTP/", 5))
+            return false;
+
+        // skip version
+        auto p = static_cast<const char *>(memchr(buf + 5, ' ', size - 5));
+        if (!p)
+            return false;
+        const char *end = buf + size;
+        while (p < end && ' ' == *p)
+            ++p;
+
+        if (end - p < 3 || !detail::isDigit(p[0]) || !detail::isDigit(p[1]) || !detail::isDigit(p[2]))
+            return false;
+        code = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+        p += 3;
+        if (p < end && ' ' != *p)
+            return false;
+
+        while (p < end && ' ' == *p)
+            ++p;
+        reason = p;
+        reasonLen = static_cast<size_t>(end - p);
+        return true;
+    }
+
+    // Parse header line like "Name: value\r\n", no allocation.
+    //   name and value point into buf, value is trimmed and may be empty.
+    // Returns:
+    //   false if not a header line.
+    inline bool parseHeaderLine(const char *buf, size_t size, const char *&name, size_t &nameLen, const char *&value, size_t &valueLen)
+    {
+        size = detail::trimLineEnd(buf, size);
+        if (0 == size || detail::isHeaderSpace(buf[0]))
+            return false;
+        auto colon = static_cast<const char *>(memchr(buf, ':', size));
+        if (!colon || colon == buf)
+            return false;
+
+        name = buf;
+        nameLen = static_cast<size_t>(colon - buf);
+
+        const char *end = buf + size;
+        const char *p = colon + 1;
+        while (p < end && detail::isHeaderSpace(*p))
+            ++p;
+        value = p;
+        valueLen = static_cast<size_t>(end - p);
+        return true;
+    }
+
+    // build url into res, the capacity of res is reused.
+    inline void makeUrl(std::string &res, const std::string& addr, const std::string& path, const std::string& query)
+    {
+        res.clear();
         res.reserve(addr.size() + path.size() + query.size() + 1);  // +1 for '?'
         res += addr;
         res += path;
@@ -33,6 +113,12 @@ namespace ppeureka { namespace http { namespace impl {
             res += '?';
             res += query;
         }
+    }
+
+    inline std::string makeUrl(const std::string& addr, const std::string& path, const std::string& query)
+    {
+        std::string res;
+        makeUrl(res, addr, path, query);
         return res;
     }
 }}}
@@ -0,0 +1,241 @@
+//  Copyright (c) 2020-2020 shadowxiali <276404541@qq.com>
+//
+//  Use, modification and distribution are subject to the
+//  Boost Software License, Version 1.0. (See accompanying file
+//  LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+
+#include "ppeureka/registry_cache.h"
+#include <algorithm>
+#include <cctype>
+
+namespace {
+    using namespace ppeureka;
+
+    inline std::string toUpper(std::string s)
+    {
+        std::transform(s.begin(), s.end(), s.begin(), [](char c){
+            return static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        });
+        return s;
+    }
+}
+
+namespace ppeureka { namespace agent {
+
+    void RegistryCache::refresh()
+    {
+        auto_lock_type alRefresh{m_lockRefresh};
+
+        {
+            auto_lock_type al{m_lock};
+            if (!m_hasData || m_needFullFetch)
+            {
+                al.unlock();
+                fullFetch();
+                return;
+            }
+        }
+
+        ApplicationsPtr delta;
+        try
+        {
+            delta = m_conn.queryAppsDelta();
+        }
+        catch (BadStatus &)
+        {
+            // delta disabled by server
+            fullFetch();
+            return;
+        }
+
+        bool match = false;
+        {
+            auto_lock_type al{m_lock};
+            ++m_deltaFetchCount;
+            match = applyDelta(*delta);
+            if (!match)
+            {
+                ++m_hashMismatchCount;
+                // the data is kept until the full fetch done
+                m_needFullFetch = true;
+            }
+        }
+        if (!match)
+            fullFetch();
+    }
+
+    void RegistryCache::bootstrap()
+    {
+        if (hasData())
+            return;
+
+        auto_lock_type alRefresh{m_lockRefresh};
+        // the concurrent callers wait the first one, and use its data
+        if (hasData())
+            return;
+        fullFetch();
+    }
+
+    void RegistryCache::reset()
+    {
+        auto_lock_type alRefresh{m_lockRefresh};
+        auto_lock_type al{m_lock};
+        m_hasData = false;
+        m_needFullFetch = false;
+        m_apps.clear();
+        m_statusCounts.clear();
+        m_appsHashCode.clear();
+    }
+
+    bool RegistryCache::hasData() const
+    {
+        auto_lock_type al{m_lock};
+        return m_hasData;
+    }
+
+    InstanceInfoPtrDeque RegistryCache::queryInsAll() const
+    {
+        InstanceInfoPtrDeque ret;
+        auto_lock_type al{m_lock};
+        for (auto &&stApp : m_apps)
+        {
+            for (auto &&stIns : stApp.second)
+            {
+                ret.emplace_back(stIns.second);
+            }
+        }
+        return ret;
+    }
+
+    InstanceInfoPtrDeque RegistryCache::queryInsByAppId(const std::string &appId) const
+    {
+        InstanceInfoPtrDeque ret;
+        auto name = toUpper(appId);
+        auto_lock_type al{m_lock};
+        auto it = m_apps.find(name);
+        if (it == m_apps.end())
+            return ret;
+        for (auto &&stIns : it->second)
+        {
+            ret.emplace_back(stIns.second);
+        }
+        return ret;
+    }
+
+    RegistryCache::Stats RegistryCache::stats() const
+    {
+        Stats st;
+        auto_lock_type al{m_lock};
+        st.fullFetchCount = m_fullFetchCount;
+        st.deltaFetchCount = m_deltaFetchCount;
+        st.hashMismatchCount = m_hashMismatchCount;
+        st.appCount = m_apps.size();
+        for (auto &&stCount : m_statusCounts)
+        {
+            st.insCount += static_cast<std::size_t>(stCount.second);
+        }
+        st.appsHashCode = m_appsHashCode;
+        return st;
+    }
+
+    void RegistryCache::fullFetch()
+    {
+        auto apps = m_conn.queryApps();
+
+        // build out of lock, the readers are not blocked by the big registry
+        AppMap newApps;
+        StatusCounts newCounts;
+        for (auto &&app : apps->apps)
+        {
+            if (!app)
+                continue;
+            auto &inses = newApps[toUpper(app->name)];
+            for (auto &&ins : app->instances)
+            {
+                if (!ins)
+                    continue;
+                addIns(inses, newCounts, ins);
+            }
+        }
+
+        auto_lock_type al{m_lock};
+        m_apps.swap(newApps);
+        m_statusCounts.swap(newCounts);
+        m_appsHashCode = apps->appsHashCode;
+        m_hasData = true;
+        m_needFullFetch = false;
+        ++m_fullFetchCount;
+    }
+
+    void RegistryCache::addIns(InstanceMap &inses, StatusCounts &counts, const InstanceInfoPtr &ins)
+    {
+        auto &old = inses[ins->instanceId];
+        if (old)
+            --counts[old->status];
+        old = ins;
+        ++counts[ins->status];
+    }
+
+    void RegistryCache::eraseIns(InstanceMap &inses, StatusCounts &counts, const std::string &insId)
+    {
+        auto it = inses.find(insId);
+        if (it == inses.end())
+            return;
+        if (it->second)
+            --counts[it->second->status];
+        inses.erase(it);
+    }
+
+    bool RegistryCache::applyDelta(const Applications &delta)
+    {
+        for (auto &&app : delta.apps)
+        {
+            if (!app)
+                continue;
+            auto name = toUpper(app->name);
+            for (auto &&ins : app->instances)
+            {
+                if (!ins)
+                    continue;
+                if (0 == ins->actionType.compare("DELETED"))
+                {
+                    auto it = m_apps.find(name);
+                    if (it == m_apps.end())
+                        continue;
+                    eraseIns(it->second, m_statusCounts, ins->instanceId);
+                    if (it->second.empty())
+                        m_apps.erase(it);
+                }
+                else
+                {
+                    // ADDED or MODIFIED
+                    addIns(m_apps[name], m_statusCounts, ins);
+                }
+            }
+        }
+
+        // the hash code of the server is kept only when match, else it is set by the full fetch
+        if (hashCode() != delta.appsHashCode)
+            return false;
+        m_appsHashCode = delta.appsHashCode;
+        return true;
+    }
+
+    std::string RegistryCache::hashCode() const
+    {
+        // std::map is in order of status, same as the server
+        std::string s;
+        for (auto &&stCount : m_statusCounts)
+        {
+            if (stCount.second <= 0)
+                continue;
+            s += stCount.first;
+            s += '_';
+            s += std::to_string(stCount.second);
+            s += '_';
+        }
+        return s;
+    }
+
+}}